@@ -0,0 +1,18 @@
+/* Stand-in for QMK deferred_exec.h, run by host_run_deferred() */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef MAX_DEFERRED_EXECUTORS
+#define MAX_DEFERRED_EXECUTORS 32
+#endif
+
+typedef uint8_t deferred_token;
+typedef uint32_t (*deferred_exec_callback)(uint32_t trigger_time, void *cb_arg);
+
+#define INVALID_DEFERRED_TOKEN 0
+
+deferred_token defer_exec(uint32_t delay_ms, deferred_exec_callback callback, void *cb_arg);
+bool extend_deferred_exec(deferred_token token, uint32_t delay_ms);
+bool cancel_deferred_exec(deferred_token token);
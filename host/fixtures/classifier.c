@@ -0,0 +1,43 @@
+/* Fixture keymap: home row mod on A with the classifier on. Odd bias and thresholds, so crossings are rounded up */
+
+#include "smtd_host.h"
+
+enum custom_keycodes {
+    SMTD_KEYCODES_BEGIN = SAFE_RANGE,
+    CKC_A,
+    SMTD_KEYCODES_END,
+};
+
+// touch: -99 + 2 * touch_ms reaches 200 at 150 ms (150 rounded up from 149.5)
+// following touch: 50 ms of touch give 1, + 3 * overlap_ms reaches 200 at 67 ms of overlap
+// release: 50 ms of touch and 50 ms of overlap give 151, - 4 * gap_ms goes down to -20 at 43 ms of gap
+#define SMTD_GLOBAL_CLASSIFIER true
+#define SMTD_CLASSIFIER_BIAS (-99)
+#define SMTD_CLASSIFIER_W_TOUCH_MS 2
+#define SMTD_CLASSIFIER_W_OVERLAP_MS 3
+#define SMTD_CLASSIFIER_W_RELEASE_GAP_MS (-4)
+#define SMTD_CLASSIFIER_HOLD_SCORE 200
+#define SMTD_CLASSIFIER_TAP_SCORE (-20)
+
+#include "sm_td.h"
+
+const uint16_t keymaps[][KEY_CNT] = {
+    {
+        [KEY_A] = CKC_A,
+    },
+};
+
+const uint8_t keymaps_layers = sizeof(keymaps) / sizeof(keymaps[0]);
+
+bool process_record_user(uint16_t keycode, keyrecord_t *record) {
+    if (!process_smtd(keycode, record)) {
+        return false;
+    }
+    return true;
+}
+
+void on_smtd_action(uint16_t keycode, smtd_action action, uint8_t tap_count) {
+    switch (keycode) {
+        SMTD_MT(CKC_A, KEY_A, KEY_LEFTSHIFT)
+    }
+}
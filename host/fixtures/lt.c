@@ -0,0 +1,55 @@
+/* Fixture keymap: two layer taps released out of order, and the old owner-less LAYER_PUSH() on right alt */
+
+#include "smtd_host.h"
+
+enum custom_keycodes {
+    SMTD_KEYCODES_BEGIN = SAFE_RANGE,
+    CKC_A,
+    CKC_S,
+    SMTD_KEYCODES_END,
+};
+
+#include "sm_td.h"
+
+enum layers {
+    BASE,
+    NUM,
+    SYM,
+};
+
+const uint16_t keymaps[][KEY_CNT] = {
+    [BASE] = {
+        [KEY_A] = CKC_A,
+        [KEY_S] = CKC_S,
+    },
+    [NUM] = {
+        [KEY_K] = KEY_1,
+    },
+    [SYM] = {
+        [KEY_K] = KEY_2,
+    },
+};
+
+const uint8_t keymaps_layers = sizeof(keymaps) / sizeof(keymaps[0]);
+
+bool process_record_user(uint16_t keycode, keyrecord_t *record) {
+    if (!process_smtd(keycode, record)) {
+        return false;
+    }
+    if (keycode == KEY_RIGHTALT) {
+        if (record->event.pressed) {
+            LAYER_PUSH(SYM)
+        } else {
+            LAYER_RESTORE()
+        }
+        return false;
+    }
+    return true;
+}
+
+void on_smtd_action(uint16_t keycode, smtd_action action, uint8_t tap_count) {
+    switch (keycode) {
+        SMTD_LT(CKC_A, KEY_A, NUM)
+        SMTD_LT(CKC_S, KEY_S, SYM)
+    }
+}
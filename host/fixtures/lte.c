@@ -0,0 +1,54 @@
+/* Fixture keymap: speculative layer tap on space, the same with aggregated taps on F, home row shift on D */
+
+#include "smtd_host.h"
+
+enum custom_keycodes {
+    SMTD_KEYCODES_BEGIN = SAFE_RANGE,
+    CKC_D,
+    CKC_F,
+    CKC_SPC,
+    SMTD_KEYCODES_END,
+};
+
+#include "sm_td.h"
+
+enum layers {
+    BASE,
+    NAV,
+};
+
+const uint16_t keymaps[][KEY_CNT] = {
+    [BASE] = {
+        [KEY_D] = CKC_D,
+        [KEY_F] = CKC_F,
+        [KEY_SPACE] = CKC_SPC,
+    },
+    [NAV] = {
+        [KEY_H] = KEY_LEFT,
+        [KEY_J] = KEY_DOWN,
+    },
+};
+
+const uint8_t keymaps_layers = sizeof(keymaps) / sizeof(keymaps[0]);
+
+bool process_record_user(uint16_t keycode, keyrecord_t *record) {
+    if (!process_smtd(keycode, record)) {
+        return false;
+    }
+    return true;
+}
+
+bool smtd_feature_enabled(uint16_t keycode, smtd_feature feature) {
+    if (keycode == CKC_F && feature == SMTD_FEATURE_AGGREGATE_TAPS) {
+        return true;
+    }
+    return smtd_feature_enabled_default(feature);
+}
+
+void on_smtd_action(uint16_t keycode, smtd_action action, uint8_t tap_count) {
+    switch (keycode) {
+        SMTD_MT(CKC_D, KEY_D, KEY_LEFTSHIFT)
+        SMTD_LTE(CKC_F, KEY_F, NAV)
+        SMTD_LTE(CKC_SPC, KEY_SPACE, NAV)
+    }
+}
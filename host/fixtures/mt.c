@@ -0,0 +1,35 @@
+/* Fixture keymap: home row mods on A and S */
+
+#include "smtd_host.h"
+
+enum custom_keycodes {
+    SMTD_KEYCODES_BEGIN = SAFE_RANGE,
+    CKC_A,
+    CKC_S,
+    SMTD_KEYCODES_END,
+};
+
+#include "sm_td.h"
+
+const uint16_t keymaps[][KEY_CNT] = {
+    {
+        [KEY_A] = CKC_A,
+        [KEY_S] = CKC_S,
+    },
+};
+
+const uint8_t keymaps_layers = sizeof(keymaps) / sizeof(keymaps[0]);
+
+bool process_record_user(uint16_t keycode, keyrecord_t *record) {
+    if (!process_smtd(keycode, record)) {
+        return false;
+    }
+    return true;
+}
+
+void on_smtd_action(uint16_t keycode, smtd_action action, uint8_t tap_count) {
+    switch (keycode) {
+        SMTD_MT(CKC_A, KEY_A, KEY_LEFTMETA)
+        SMTD_MT(CKC_S, KEY_S, KEY_LEFTALT)
+    }
+}
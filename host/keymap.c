@@ -0,0 +1,69 @@
+/* Example host keymap: home row mods on ASDF/JKL; and a navigation layer on space.
+ * Copy it, edit to your taste and build with `make KEYMAP=your_keymap.c`.
+ */
+
+#include "smtd_host.h"
+
+enum custom_keycodes {
+    SMTD_KEYCODES_BEGIN = SAFE_RANGE,
+    CKC_A,
+    CKC_S,
+    CKC_D,
+    CKC_F,
+    CKC_J,
+    CKC_K,
+    CKC_L,
+    CKC_SCLN,
+    CKC_SPC,
+    SMTD_KEYCODES_END,
+};
+
+#include "sm_td.h"
+
+enum layers {
+    BASE,
+    NAV,
+};
+
+const uint16_t keymaps[][KEY_CNT] = {
+    [BASE] = {
+        [KEY_A] = CKC_A,
+        [KEY_S] = CKC_S,
+        [KEY_D] = CKC_D,
+        [KEY_F] = CKC_F,
+        [KEY_J] = CKC_J,
+        [KEY_K] = CKC_K,
+        [KEY_L] = CKC_L,
+        [KEY_SEMICOLON] = CKC_SCLN,
+        [KEY_SPACE] = CKC_SPC,
+    },
+    [NAV] = {
+        [KEY_H] = KEY_LEFT,
+        [KEY_J] = KEY_DOWN,
+        [KEY_K] = KEY_UP,
+        [KEY_L] = KEY_RIGHT,
+    },
+};
+
+const uint8_t keymaps_layers = sizeof(keymaps) / sizeof(keymaps[0]);
+
+bool process_record_user(uint16_t keycode, keyrecord_t *record) {
+    if (!process_smtd(keycode, record)) {
+        return false;
+    }
+    return true;
+}
+
+void on_smtd_action(uint16_t keycode, smtd_action action, uint8_t tap_count) {
+    switch (keycode) {
+        SMTD_MT(CKC_A, KEY_A, KEY_LEFTMETA)
+        SMTD_MT(CKC_S, KEY_S, KEY_LEFTALT)
+        SMTD_MT(CKC_D, KEY_D, KEY_LEFTCTRL)
+        SMTD_MT(CKC_F, KEY_F, KEY_LEFTSHIFT)
+        SMTD_MT(CKC_J, KEY_J, KEY_RIGHTSHIFT)
+        SMTD_MT(CKC_K, KEY_K, KEY_RIGHTCTRL)
+        SMTD_MT(CKC_L, KEY_L, KEY_RIGHTALT)
+        SMTD_MT(CKC_SCLN, KEY_SEMICOLON, KEY_RIGHTMETA)
+        SMTD_LT(CKC_SPC, KEY_SPACE, NAV)
+    }
+}
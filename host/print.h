@@ -0,0 +1,6 @@
+/* Stand-in for QMK print.h, debug output goes to stderr to keep stdout for key events */
+#pragma once
+
+#include <stdio.h>
+
+#define printf(...) fprintf(stderr, __VA_ARGS__)
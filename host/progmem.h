@@ -0,0 +1,9 @@
+/* Stand-in for QMK progmem.h, the host has a flat address space */
+#pragma once
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *) (address))
+#define pgm_read_word(address) (*(const uint16_t *) (address))
+#define pgm_read_dword(address) (*(const uint32_t *) (address))
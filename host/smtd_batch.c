@@ -0,0 +1,983 @@
+/* Copyright 2024 Stanislav Markin (https://github.com/stasmarkin)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * smtd-batch: runs one trace through sm_td with many timeout configurations at once.
+ *
+ * Every SIMD lane holds one configuration of SMTD_TIMEOUT_* terms. Lanes are stepped through
+ * the trace together with a structure-of-arrays model of smtd_active_states, built with
+ * GCC/Clang vector extensions, so the same code is compiled to AVX2, SSE or NEON.
+ * The result of each lane is a digest of TAP/HOLD decisions (event, keycode, action, sequence_len)
+ * in the order sm_td makes them.
+ *
+ * The model keeps one not yet held state per lane, states in SMTD_STAGE_HOLD are kept as a set
+ * of keycodes, since they only wait for their own release. Whenever sm_td would get into
+ * something else (two states deciding at the same time, a replayed key releasing a held state),
+ * the lane is marked as escaped. The trace is run in short segments: an escaped lane is rerun
+ * from the segment start by the scalar fallback (the real sm_td.h embedded here) and is put back
+ * into the model at the end of the first segment where its states fit it again.
+ *
+ * Assumes global timeouts, no SMTD_FEATURE_AGGREGATE_TAPS and no classifier.
+ * The lane count follows the target vector width, -DSMTD_BATCH_LANES=1 builds a plain scalar model.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smtd_host.h"
+#include "smtd_trace.h"
+
+/** Macro keycodes are strictly between them, as with SMTD_KEYCODES_BEGIN and SMTD_KEYCODES_END in a keymap */
+static uint16_t batch_keycodes_begin = SAFE_RANGE;
+static uint16_t batch_keycodes_end = SAFE_RANGE + 0x100;
+
+#define SMTD_KEYCODES_BEGIN batch_keycodes_begin
+#define SMTD_KEYCODES_END batch_keycodes_end
+
+#include "sm_td.h"
+
+// one native vector register of 32-bit lanes
+#ifndef SMTD_BATCH_LANES
+#if defined(__AVX512F__)
+#define SMTD_BATCH_LANES 16
+#elif defined(__AVX2__)
+#define SMTD_BATCH_LANES 8
+#else
+#define SMTD_BATCH_LANES 4
+#endif
+#endif
+
+/** Max held states per lane in the SIMD model, scalar sm_td allows 10 states in total */
+#define BATCH_HELD_SIZE 8
+
+#define BATCH_DIGEST_BASIS 2166136261u
+#define BATCH_DIGEST_PRIME 16777619u
+
+typedef struct {
+    uint32_t tap;
+    uint32_t sequence;
+    uint32_t following_tap;
+    uint32_t release;
+} batch_config;
+
+typedef struct {
+    uint32_t digest;
+    uint32_t taps;
+    uint32_t holds;
+} batch_result;
+
+typedef struct {
+    size_t count;
+    uint32_t *time_ms;
+    uint32_t *session;
+    uint16_t *keycode;
+    /** HOST_KEYPOS_CODE() of the event position */
+    uint16_t *position;
+    uint8_t *pressed;
+} batch_events;
+
+static inline uint32_t batch_digest(uint32_t digest, uint32_t index, uint32_t decision) {
+    return ((digest ^ index) * BATCH_DIGEST_PRIME ^ decision) * BATCH_DIGEST_PRIME;
+}
+
+static inline uint32_t batch_decision(uint32_t keycode, smtd_action action, uint32_t sequence_len) {
+    return keycode | (uint32_t) action << 16 | sequence_len << 24;
+}
+
+/* ************************************* *
+ *            SCALAR FALLBACK            *
+ * ************************************* */
+
+static const batch_config *scalar_config;
+static batch_result *scalar_result;
+static uint32_t scalar_index;
+static uint32_t scalar_now;
+static uint8_t scalar_mods;
+
+/** Keycode of the last press at each position, replayed keys are resolved with it */
+static uint16_t scalar_keycodes[0x10000];
+
+uint32_t get_smtd_timeout(uint16_t keycode, smtd_timeout timeout) {
+    switch (timeout) {
+        case SMTD_TIMEOUT_TAP:
+            return scalar_config->tap;
+        case SMTD_TIMEOUT_SEQUENCE:
+            return scalar_config->sequence;
+        case SMTD_TIMEOUT_FOLLOWING_TAP:
+            return scalar_config->following_tap;
+        case SMTD_TIMEOUT_RELEASE:
+            return scalar_config->release;
+    }
+    return 0;
+}
+
+void on_smtd_action(uint16_t keycode, smtd_action action, uint8_t tap_count) {
+    if (action != SMTD_ACTION_TAP && action != SMTD_ACTION_HOLD) {
+        return;
+    }
+    scalar_result->digest = batch_digest(scalar_result->digest, scalar_index,
+                                         batch_decision(keycode, action, tap_count));
+    if (action == SMTD_ACTION_TAP) {
+        scalar_result->taps++;
+    } else {
+        scalar_result->holds++;
+    }
+}
+
+uint16_t timer_read(void) {
+    return (uint16_t) scalar_now;
+}
+
+uint32_t timer_read32(void) {
+    return scalar_now;
+}
+
+uint16_t timer_elapsed(uint16_t last) {
+    return (uint16_t) (scalar_now - last);
+}
+
+uint32_t timer_elapsed32(uint32_t last) {
+    return scalar_now - last;
+}
+
+uint8_t get_mods(void) {
+    return scalar_mods;
+}
+
+void set_mods(uint8_t mods) {
+    scalar_mods = mods;
+}
+
+void del_mods(uint8_t mods) {
+    scalar_mods &= ~mods;
+}
+
+void send_keyboard_report(void) {
+}
+
+void wait_ms(uint32_t ms) {
+}
+
+// layers are only changed by on_smtd_action() macros, which are not run here
+
+layer_state_t layer_state = 0;
+
+uint8_t get_highest_layer(layer_state_t state) {
+    return 0;
+}
+
+void layer_move(uint8_t layer) {
+}
+
+void process_record(keyrecord_t *record) {
+    process_smtd(scalar_keycodes[HOST_KEYPOS_CODE(record->event.key)], record);
+}
+
+// same semantics as the deferred executors of smtd-host
+
+typedef struct {
+    deferred_token token;
+    uint32_t trigger_time;
+    deferred_exec_callback callback;
+    void *cb_arg;
+} scalar_executor;
+
+static scalar_executor scalar_executors[MAX_DEFERRED_EXECUTORS];
+static deferred_token scalar_last_token;
+
+deferred_token defer_exec(uint32_t delay_ms, deferred_exec_callback callback, void *cb_arg) {
+    if (delay_ms == 0) {
+        return INVALID_DEFERRED_TOKEN;
+    }
+    for (uint8_t i = 0; i < MAX_DEFERRED_EXECUTORS; i++) {
+        scalar_executor *executor = &scalar_executors[i];
+        if (executor->token != INVALID_DEFERRED_TOKEN) continue;
+
+        if (++scalar_last_token == INVALID_DEFERRED_TOKEN) scalar_last_token++;
+        executor->token = scalar_last_token;
+        executor->trigger_time = scalar_now + delay_ms;
+        executor->callback = callback;
+        executor->cb_arg = cb_arg;
+        return executor->token;
+    }
+    return INVALID_DEFERRED_TOKEN;
+}
+
+bool cancel_deferred_exec(deferred_token token) {
+    for (uint8_t i = 0; token != INVALID_DEFERRED_TOKEN && i < MAX_DEFERRED_EXECUTORS; i++) {
+        if (scalar_executors[i].token == token) {
+            scalar_executors[i].token = INVALID_DEFERRED_TOKEN;
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Fires callbacks due at `now_ms`, or all of them if `drain` */
+static void scalar_run_deferred(uint32_t now_ms, bool drain) {
+    for (;;) {
+        scalar_executor *earliest = NULL;
+        for (uint8_t i = 0; i < MAX_DEFERRED_EXECUTORS; i++) {
+            scalar_executor *executor = &scalar_executors[i];
+            if (executor->token == INVALID_DEFERRED_TOKEN) continue;
+            if (!earliest || (int32_t) (executor->trigger_time - earliest->trigger_time) < 0) earliest = executor;
+        }
+        if (!earliest || (!drain && (int32_t) (earliest->trigger_time - now_ms) > 0)) break;
+
+        // sm_td callbacks never reschedule themselves
+        earliest->token = INVALID_DEFERRED_TOKEN;
+        scalar_now = earliest->trigger_time;
+        earliest->callback(earliest->trigger_time, earliest->cb_arg);
+    }
+}
+
+#define SCALAR_STATES_SIZE (sizeof(smtd_active_states) / sizeof(smtd_active_states[0]))
+
+static void scalar_reset(void) {
+    for (uint8_t i = 0; i < SCALAR_STATES_SIZE; i++) {
+        smtd_active_states[i] = (smtd_state) EMPTY_STATE;
+    }
+    smtd_active_states_size = 0;
+    memset(scalar_executors, 0, sizeof(scalar_executors));
+    scalar_mods = 0;
+    scalar_now = 0;
+}
+
+/** Runs events [from, to) from the current scalar state, the end of the trace also fires pending timeouts */
+static void scalar_run_events(const batch_events *events, size_t from, size_t to) {
+    for (size_t i = from; i < to; i++) {
+        scalar_index = (uint32_t) i;
+        if (i > 0 && events->session[i] != events->session[i - 1]) {
+            scalar_run_deferred(0, true);
+        }
+        scalar_run_deferred(events->time_ms[i], false);
+        scalar_now = events->time_ms[i];
+
+        uint16_t position = events->position[i];
+        if (events->pressed[i]) scalar_keycodes[position] = events->keycode[i];
+        keyrecord_t record = {.event = MAKE_KEYEVENT(position >> 8, position & 0xFF, events->pressed[i])};
+        process_smtd(events->keycode[i], &record);
+    }
+
+    if (to == events->count) {
+        scalar_index = (uint32_t) events->count;
+        scalar_run_deferred(0, true);
+    }
+}
+
+static void scalar_run(const batch_events *events, const batch_config *config, batch_result *result) {
+    scalar_reset();
+    memset(scalar_keycodes, 0, sizeof(scalar_keycodes));
+
+    scalar_config = config;
+    scalar_result = result;
+    *result = (batch_result) {.digest = BATCH_DIGEST_BASIS};
+    scalar_run_events(events, 0, events->count);
+}
+
+static bool scalar_replays_following(const smtd_state *state) {
+    return state->stage == SMTD_STAGE_FOLLOWING_TOUCH || state->stage == SMTD_STAGE_RELEASE;
+}
+
+/**
+ * A lane run by the scalar fallback between segments. scalar_keycodes is shared by all lanes,
+ * but only keycodes of following keys are read before the next press at the same position sets them again,
+ * so they are the only ones kept.
+ */
+typedef struct {
+    smtd_state states[SCALAR_STATES_SIZE];
+    uint8_t states_size;
+    uint16_t following_keycodes[SCALAR_STATES_SIZE];
+    scalar_executor executors[MAX_DEFERRED_EXECUTORS];
+    deferred_token last_token;
+    batch_result result;
+} scalar_context;
+
+static void scalar_save(scalar_context *context) {
+    memcpy(context->states, smtd_active_states, sizeof(context->states));
+    context->states_size = smtd_active_states_size;
+    for (uint8_t i = 0; i < smtd_active_states_size; i++) {
+        context->following_keycodes[i] = scalar_keycodes[HOST_KEYPOS_CODE(smtd_active_states[i].following_key)];
+    }
+    memcpy(context->executors, scalar_executors, sizeof(context->executors));
+    context->last_token = scalar_last_token;
+}
+
+static void scalar_restore(scalar_context *context) {
+    memcpy(smtd_active_states, context->states, sizeof(context->states));
+    smtd_active_states_size = context->states_size;
+    for (uint8_t i = 0; i < smtd_active_states_size; i++) {
+        if (!scalar_replays_following(&smtd_active_states[i])) continue;
+        scalar_keycodes[HOST_KEYPOS_CODE(smtd_active_states[i].following_key)] = context->following_keycodes[i];
+    }
+    memcpy(scalar_executors, context->executors, sizeof(scalar_executors));
+    scalar_last_token = context->last_token;
+    scalar_result = &context->result;
+}
+
+/* ************************************* *
+ *              SIMD LANES               *
+ * ************************************* */
+
+typedef uint32_t lane_u32 __attribute__((vector_size(SMTD_BATCH_LANES * sizeof(uint32_t))));
+typedef int32_t lane_i32 __attribute__((vector_size(SMTD_BATCH_LANES * sizeof(int32_t))));
+
+/** Comparisons give 0 or -1 per lane, which is used as a bit mask */
+#define LANE_MASK(condition) ((lane_u32) (condition))
+
+static const lane_u32 lane_zero = {0};
+
+static inline lane_u32 lane_select(lane_u32 mask, lane_u32 a, lane_u32 b) {
+    return (a & mask) | (b & ~mask);
+}
+
+static inline bool lane_any(lane_u32 mask) {
+    uint32_t any = 0;
+    for (int i = 0; i < SMTD_BATCH_LANES; i++) {
+        any |= mask[i];
+    }
+    return any != 0;
+}
+
+typedef struct {
+    lane_u32 tap_term;
+    lane_u32 sequence_term;
+    lane_u32 following_tap_term;
+    lane_u32 release_term;
+
+    /** The state that is not held yet, it is always the last one in smtd_active_states */
+    lane_u32 stage;
+    lane_u32 keycode;
+    lane_u32 sequence_len;
+    lane_u32 following_position;
+    lane_u32 following_keycode;
+    lane_u32 deadline;
+    lane_u32 armed;
+
+    /** Keycodes of states in SMTD_STAGE_HOLD, 0 is a free slot */
+    lane_u32 held[BATCH_HELD_SIZE];
+
+    /** Lanes that left the model in the current segment or are still run by the scalar fallback */
+    lane_u32 escaped;
+
+    lane_u32 digest;
+    lane_u32 taps;
+    lane_u32 holds;
+} batch_lanes;
+
+static inline lane_u32 lanes_is_macro(lane_u32 keycode) {
+    return LANE_MASK(keycode > batch_keycodes_begin) & LANE_MASK(keycode < batch_keycodes_end);
+}
+
+static inline lane_u32 lanes_held_contains(const batch_lanes *lanes, lane_u32 keycode) {
+    lane_u32 found = lane_zero;
+    for (int i = 0; i < BATCH_HELD_SIZE; i++) {
+        found |= LANE_MASK(lanes->held[i] == keycode);
+    }
+    return found;
+}
+
+static inline void lanes_record(batch_lanes *lanes, lane_u32 mask, uint32_t index, smtd_action action) {
+    lane_u32 decision = lanes->keycode | (uint32_t) action << 16 | lanes->sequence_len << 24;
+    lane_u32 digest = ((lanes->digest ^ index) * BATCH_DIGEST_PRIME ^ decision) * BATCH_DIGEST_PRIME;
+    lanes->digest = lane_select(mask, digest, lanes->digest);
+    if (action == SMTD_ACTION_TAP) {
+        lanes->taps -= mask;
+    } else {
+        lanes->holds -= mask;
+    }
+}
+
+/** Same as smtd_next_stage: the new stage timeout starts at `now` */
+static inline void lanes_enter(batch_lanes *lanes, lane_u32 mask, smtd_stage stage, lane_u32 now, lane_u32 term) {
+    lanes->stage = lane_select(mask, lane_zero + (uint32_t) stage, lanes->stage);
+    lanes->deadline = lane_select(mask, now + term, lanes->deadline);
+    // defer_exec doesn't schedule zero delay
+    lanes->armed = lane_select(mask, LANE_MASK(term != 0), lanes->armed);
+}
+
+static inline void lanes_clear(batch_lanes *lanes, lane_u32 mask) {
+    lanes->stage = lane_select(mask, lane_zero + SMTD_STAGE_NONE, lanes->stage);
+    lanes->armed &= ~mask;
+}
+
+static inline void lanes_touch(batch_lanes *lanes, lane_u32 mask, lane_u32 keycode, lane_u32 now) {
+    lanes->keycode = lane_select(mask, keycode, lanes->keycode);
+    lanes->sequence_len &= ~mask;
+    lanes_enter(lanes, mask, SMTD_STAGE_TOUCH, now, lanes->tap_term);
+}
+
+/** Moves the state to the held set */
+static inline void lanes_hold(batch_lanes *lanes, lane_u32 mask) {
+    lane_u32 pending = mask;
+    for (int i = 0; i < BATCH_HELD_SIZE; i++) {
+        lane_u32 slot = pending & LANE_MASK(lanes->held[i] == 0);
+        lanes->held[i] = lane_select(slot, lanes->keycode, lanes->held[i]);
+        pending &= ~slot;
+    }
+    lanes->escaped |= pending;
+    lanes_clear(lanes, mask);
+}
+
+static void lanes_init(batch_lanes *lanes, const batch_config *configs, size_t count) {
+    memset(lanes, 0, sizeof(*lanes));
+    for (int i = 0; i < SMTD_BATCH_LANES; i++) {
+        // the last group is padded with copies of the last config
+        const batch_config *config = &configs[(size_t) i < count ? (size_t) i : count - 1];
+        lanes->tap_term[i] = config->tap;
+        lanes->sequence_term[i] = config->sequence;
+        lanes->following_tap_term[i] = config->following_tap;
+        lanes->release_term[i] = config->release;
+    }
+    lanes->digest = lane_zero + BATCH_DIGEST_BASIS;
+}
+
+/** Fires stage timeouts due at `now_ms`, or all of them if `drain`, see smtd_transitions[][SMTD_EVENT_TIMEOUT] */
+static void lanes_timeouts(batch_lanes *lanes, uint32_t index, uint32_t now_ms, bool drain) {
+    for (;;) {
+        lane_u32 due = lanes->armed & ~lanes->escaped;
+        if (!drain) due &= LANE_MASK((lane_i32) (lanes->deadline - now_ms) <= 0);
+        if (!lane_any(due)) return;
+
+        // callbacks see the clock at their trigger time
+        lane_u32 now = lanes->deadline;
+        lane_u32 touch = due & LANE_MASK(lanes->stage == SMTD_STAGE_TOUCH);
+        lane_u32 sequence = due & LANE_MASK(lanes->stage == SMTD_STAGE_SEQUENCE);
+        lane_u32 following_touch = due & LANE_MASK(lanes->stage == SMTD_STAGE_FOLLOWING_TOUCH);
+        lane_u32 release = due & LANE_MASK(lanes->stage == SMTD_STAGE_RELEASE);
+
+        // pressing the following key creates its own state if it is a macro key not handled yet
+        lane_u32 following = lanes->following_keycode;
+        lane_u32 following_new = lanes_is_macro(following) & ~lanes_held_contains(lanes, following)
+                                 & LANE_MASK(following != lanes->keycode);
+
+        lanes_record(lanes, touch | following_touch, index, SMTD_ACTION_HOLD);
+        lanes_record(lanes, release, index, SMTD_ACTION_TAP);
+        lanes_hold(lanes, touch | following_touch);
+        lanes_clear(lanes, sequence | release);
+        lanes_touch(lanes, (following_touch | release) & following_new, following, now);
+    }
+}
+
+/** One key event, see smtd_transitions[] and process_smtd(). Blocks not taken by any lane are skipped */
+static void lanes_event(batch_lanes *lanes, uint32_t index, uint32_t now_ms, uint16_t keycode, uint16_t position,
+                        bool pressed) {
+    lane_u32 live = ~lanes->escaped;
+    lane_u32 now = lane_zero + now_ms;
+    lane_u32 key = lane_zero + keycode;
+    bool is_macro = keycode > batch_keycodes_begin && keycode < batch_keycodes_end;
+
+    // held states come first in smtd_active_states and only handle their own release
+    if (!pressed && is_macro) {
+        for (int i = 0; i < BATCH_HELD_SIZE; i++) {
+            lane_u32 released = live & LANE_MASK(lanes->held[i] == key);
+            lanes->held[i] &= ~released;
+            live &= ~released;
+        }
+    }
+
+    lane_u32 active = live & LANE_MASK(lanes->stage != SMTD_STAGE_NONE);
+    if (!is_macro && !lane_any(active)) {
+        return;
+    }
+
+    lane_u32 own = LANE_MASK(lanes->keycode == key);
+    lane_u32 following = ~own & LANE_MASK(lanes->following_position == position);
+    lane_u32 in_touch = active & LANE_MASK(lanes->stage == SMTD_STAGE_TOUCH);
+    lane_u32 in_sequence = active & LANE_MASK(lanes->stage == SMTD_STAGE_SEQUENCE);
+    lane_u32 in_following_touch = active & LANE_MASK(lanes->stage == SMTD_STAGE_FOLLOWING_TOUCH);
+    lane_u32 in_release = active & LANE_MASK(lanes->stage == SMTD_STAGE_RELEASE);
+
+    // replaying the following key creates its own state if it is a macro key not handled yet
+    lane_u32 replayed = lanes->following_keycode;
+    lane_u32 replayed_held = lane_zero;
+    lane_u32 replayed_new = lane_zero;
+    if (lane_any(in_following_touch | in_release)) {
+        replayed_held = lanes_held_contains(lanes, replayed);
+        replayed_new = lanes_is_macro(replayed) & ~replayed_held & LANE_MASK(replayed != lanes->keycode);
+    }
+
+    if (!pressed) {
+        lane_u32 tap = in_touch & own;
+        lane_u32 release = in_following_touch & own;
+        lane_u32 hold_tap = in_following_touch & following;
+        lane_u32 late_tap = in_release & following;
+        lane_u32 tapped = hold_tap | late_tap;
+
+        if (lane_any(tap)) {
+            lanes_record(lanes, tap, index, SMTD_ACTION_TAP);
+            lanes_enter(lanes, tap, SMTD_STAGE_SEQUENCE, now, lanes->sequence_term);
+        }
+        lanes_enter(lanes, release, SMTD_STAGE_RELEASE, now, lanes->release_term);
+
+        if (lane_any(tapped)) {
+            // the following key is tapped, its release would release a held state and shift the others
+            lanes->escaped |= tapped & replayed_held;
+            lanes_record(lanes, tapped, index, SMTD_ACTION_HOLD);
+            lanes_hold(lanes, hold_tap);
+            lanes_clear(lanes, late_tap);
+
+            // a macro following key gets its state created and tapped right away
+            lane_u32 created = tapped & replayed_new;
+            if (lane_any(created)) {
+                lanes_touch(lanes, created, replayed, now);
+                lanes_record(lanes, created, index, SMTD_ACTION_TAP);
+                lanes_enter(lanes, created, SMTD_STAGE_SEQUENCE, now, lanes->sequence_term);
+            }
+        }
+        return;
+    }
+
+    lane_u32 follow = in_touch & ~own;
+    lane_u32 next_touch = in_sequence & own;
+    lane_u32 sequence_end = in_sequence & ~own;
+    lane_u32 roll = in_following_touch & ~own & ~following;
+    lane_u32 retouch = in_release & own;
+    lane_u32 release_end = in_release & ~own & ~following;
+    lane_u32 vacant = live & ~active;
+
+    // the same position pressed twice without a release, only possible with a broken trace
+    lanes->escaped |= (in_following_touch | in_release) & following;
+
+    if (lane_any(follow)) {
+        lanes->following_position = lane_select(follow, lane_zero + position, lanes->following_position);
+        lanes->following_keycode = lane_select(follow, key, lanes->following_keycode);
+        lanes_enter(lanes, follow, SMTD_STAGE_FOLLOWING_TOUCH, now, lanes->following_tap_term);
+    }
+
+    lanes->sequence_len -= next_touch;
+    lanes_enter(lanes, next_touch, SMTD_STAGE_TOUCH, now, lanes->tap_term);
+    lanes_clear(lanes, sequence_end);
+
+    lane_u32 replaying = roll | release_end;
+    if (lane_any(retouch | replaying)) {
+        // the macro key is tapped again while the following key is held, so both would be deciding at once
+        lanes->escaped |= retouch & replayed_new;
+        lanes_record(lanes, retouch | release_end, index, SMTD_ACTION_TAP);
+        lanes_enter(lanes, retouch, SMTD_STAGE_TOUCH, now, lanes->tap_term);
+        lanes->sequence_len &= ~retouch;
+
+        lanes_record(lanes, roll, index, SMTD_ACTION_HOLD);
+        lanes_hold(lanes, roll);
+        lanes_clear(lanes, release_end);
+
+        // the following key is pressed and the current key is replayed, the following key state takes it
+        lane_u32 created = replaying & replayed_new;
+        lane_u32 created_follow = created & LANE_MASK(replayed != key);
+        lanes_touch(lanes, created, replayed, now);
+        lanes->following_position = lane_select(created_follow, lane_zero + position, lanes->following_position);
+        lanes->following_keycode = lane_select(created_follow, key, lanes->following_keycode);
+        lanes_enter(lanes, created_follow, SMTD_STAGE_FOLLOWING_TOUCH, now, lanes->following_tap_term);
+    }
+
+    // nobody handled the key, so it may start a new state
+    if (is_macro) {
+        lane_u32 idle = vacant | sequence_end | (replaying & ~replayed_new);
+        if (lane_any(idle)) {
+            lanes_touch(lanes, idle & ~lanes_held_contains(lanes, key), key, now);
+        }
+    }
+}
+
+/** Runs events [from, to), the end of the trace also fires pending timeouts */
+static void lanes_run(const batch_events *events, batch_lanes *lanes, size_t from, size_t to) {
+    for (size_t i = from; i < to; i++) {
+        if (i > 0 && events->session[i] != events->session[i - 1]) {
+            lanes_timeouts(lanes, (uint32_t) i, 0, true);
+        }
+        lanes_timeouts(lanes, (uint32_t) i, events->time_ms[i], false);
+        lanes_event(lanes, (uint32_t) i, events->time_ms[i], events->keycode[i], events->position[i],
+                    events->pressed[i]);
+    }
+    if (to == events->count) {
+        lanes_timeouts(lanes, (uint32_t) events->count, 0, true);
+    }
+}
+
+/* ************************************* *
+ *        LANES <-> SCALAR STATES        *
+ * ************************************* */
+
+static deferred_exec_callback scalar_stage_callback(smtd_stage stage) {
+    switch (stage) {
+        case SMTD_STAGE_TOUCH:
+            return timeout_touch;
+        case SMTD_STAGE_SEQUENCE:
+            return timeout_sequence;
+        case SMTD_STAGE_FOLLOWING_TOUCH:
+            return timeout_following_touch;
+        case SMTD_STAGE_RELEASE:
+            return timeout_release;
+        default:
+            return NULL;
+    }
+}
+
+/** Builds scalar smtd_active_states from one lane, held states first and the deciding one last, as sm_td keeps them */
+static void scalar_from_lane(const batch_lanes *lanes, int lane, batch_result *result) {
+    scalar_reset();
+    for (int i = 0; i < BATCH_HELD_SIZE; i++) {
+        if (!lanes->held[i][lane]) continue;
+        smtd_state *state = &smtd_active_states[smtd_active_states_size++];
+        state->macro_keycode = (uint16_t) lanes->held[i][lane];
+        state->stage = SMTD_STAGE_HOLD;
+    }
+
+    if (lanes->stage[lane] != SMTD_STAGE_NONE) {
+        smtd_state *state = &smtd_active_states[smtd_active_states_size++];
+        uint16_t following = (uint16_t) lanes->following_position[lane];
+        state->macro_keycode = (uint16_t) lanes->keycode[lane];
+        state->stage = (smtd_stage) lanes->stage[lane];
+        state->sequence_len = (uint8_t) lanes->sequence_len[lane];
+        state->following_key = (keypos_t) MAKE_KEYPOS(following >> 8, following & 0xFF);
+        state->following_keycode = (uint16_t) lanes->following_keycode[lane];
+        if (scalar_replays_following(state)) {
+            scalar_keycodes[following] = state->following_keycode;
+        }
+        if (lanes->armed[lane]) {
+            if (++scalar_last_token == INVALID_DEFERRED_TOKEN) scalar_last_token++;
+            scalar_executors[0] = (scalar_executor) {
+                .token = scalar_last_token,
+                .trigger_time = lanes->deadline[lane],
+                .callback = scalar_stage_callback(state->stage),
+                .cb_arg = (void *) (uintptr_t) state->macro_keycode,
+            };
+            state->timeout = scalar_last_token;
+        }
+    }
+
+    *result = (batch_result) {.digest = lanes->digest[lane], .taps = lanes->taps[lane], .holds = lanes->holds[lane]};
+    scalar_result = result;
+}
+
+/** Puts the scalar states back into the lane, if they fit the model: held states and at most one deciding state */
+static bool scalar_to_lane(batch_lanes *lanes, int lane) {
+    uint32_t held[BATCH_HELD_SIZE] = {0};
+    int held_count = 0;
+    const smtd_state *deciding = NULL;
+
+    for (uint8_t i = 0; i < smtd_active_states_size; i++) {
+        const smtd_state *state = &smtd_active_states[i];
+        if (state->freeze) return false;
+        if (state->stage != SMTD_STAGE_HOLD) {
+            if (i != smtd_active_states_size - 1) return false;
+            deciding = state;
+            continue;
+        }
+        if (held_count == BATCH_HELD_SIZE) return false;
+        held[held_count++] = state->macro_keycode;
+    }
+
+    // the only pending timeout must be the stage timeout of the deciding state
+    const scalar_executor *timeout = NULL;
+    for (int i = 0; i < MAX_DEFERRED_EXECUTORS; i++) {
+        const scalar_executor *executor = &scalar_executors[i];
+        if (executor->token == INVALID_DEFERRED_TOKEN) continue;
+        if (timeout || !deciding || executor->token != deciding->timeout) return false;
+        timeout = executor;
+    }
+
+    if (deciding && scalar_replays_following(deciding)
+        && scalar_keycodes[HOST_KEYPOS_CODE(deciding->following_key)] != deciding->following_keycode) {
+        return false;
+    }
+
+    for (int i = 0; i < BATCH_HELD_SIZE; i++) {
+        lanes->held[i][lane] = held[i];
+    }
+    lanes->stage[lane] = deciding ? deciding->stage : SMTD_STAGE_NONE;
+    if (deciding) {
+        lanes->keycode[lane] = deciding->macro_keycode;
+        lanes->sequence_len[lane] = deciding->sequence_len;
+        lanes->following_position[lane] = HOST_KEYPOS_CODE(deciding->following_key);
+        lanes->following_keycode[lane] = deciding->following_keycode;
+    }
+    lanes->armed[lane] = timeout ? ~0u : 0;
+    lanes->deadline[lane] = timeout ? timeout->trigger_time : 0;
+    lanes->digest[lane] = scalar_result->digest;
+    lanes->taps[lane] = scalar_result->taps;
+    lanes->holds[lane] = scalar_result->holds;
+    lanes->escaped[lane] = 0;
+    return true;
+}
+
+/* ************************************* *
+ *               BATCH RUN               *
+ * ************************************* */
+
+/** Events per segment: an escaped lane is rerun by the scalar fallback from the segment start */
+#define BATCH_SEGMENT_SIZE 16
+
+typedef struct {
+    size_t segments;
+    size_t scalar_segments;
+} batch_stats;
+
+/**
+ * The trace is run in segments. Lanes that escape the model in a segment are rerun from the lane state
+ * at its start by scalar sm_td, and get back into the SIMD model as soon as their states fit it again
+ * at the end of some segment. Until then they stay with the scalar fallback, segment by segment.
+ */
+static void batch_run(const batch_events *events, const batch_config *configs, size_t count,
+                      batch_result *results, batch_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    memset(scalar_keycodes, 0, sizeof(scalar_keycodes));
+    static scalar_context contexts[SMTD_BATCH_LANES];
+
+    for (size_t group = 0; group < count; group += SMTD_BATCH_LANES) {
+        size_t lanes_count = count - group < SMTD_BATCH_LANES ? count - group : SMTD_BATCH_LANES;
+        bool in_scalar[SMTD_BATCH_LANES] = {false};
+
+        batch_lanes lanes;
+        lanes_init(&lanes, &configs[group], lanes_count);
+
+        for (size_t from = 0; from < events->count || from == 0; from += BATCH_SEGMENT_SIZE) {
+            size_t to = events->count - from < BATCH_SEGMENT_SIZE ? events->count : from + BATCH_SEGMENT_SIZE;
+            batch_lanes checkpoint = lanes;
+            lanes_run(events, &lanes, from, to);
+            stats->segments += lanes_count;
+            if (!lane_any(lanes.escaped)) continue;
+
+            for (size_t i = 0; i < lanes_count; i++) {
+                if (!lanes.escaped[i]) continue;
+
+                scalar_config = &configs[group + i];
+                if (in_scalar[i]) {
+                    scalar_restore(&contexts[i]);
+                } else {
+                    scalar_from_lane(&checkpoint, (int) i, &contexts[i].result);
+                }
+                scalar_run_events(events, from, to);
+                stats->scalar_segments++;
+
+                in_scalar[i] = !scalar_to_lane(&lanes, (int) i);
+                if (in_scalar[i]) {
+                    scalar_save(&contexts[i]);
+                    lanes.escaped[i] = ~0u;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < lanes_count; i++) {
+            results[group + i] = in_scalar[i] ? contexts[i].result : (batch_result) {
+                .digest = lanes.digest[i],
+                .taps = lanes.taps[i],
+                .holds = lanes.holds[i],
+            };
+        }
+    }
+}
+
+/* ************************************* *
+ *                 MAIN                  *
+ * ************************************* */
+
+static bool load_events(const char *path, batch_events *events) {
+    smtd_trace trace;
+    if (!smtd_trace_open(&trace, path)) {
+        fprintf(stderr, "%s: %s\n", path, smtd_trace_error());
+        return false;
+    }
+
+    size_t count = trace.header->events_count;
+    events->time_ms = malloc(count * sizeof(uint32_t));
+    events->session = malloc(count * sizeof(uint32_t));
+    events->keycode = malloc(count * sizeof(uint16_t));
+    events->position = malloc(count * sizeof(uint16_t));
+    events->pressed = malloc(count);
+    if (count && (!events->time_ms || !events->session || !events->keycode || !events->position || !events->pressed)) {
+        perror("malloc");
+        smtd_trace_close(&trace);
+        return false;
+    }
+
+    smtd_trace_cursor cursor;
+    smtd_trace_cursor_init(&cursor, &trace, 0);
+    smtd_trace_event event;
+    events->count = 0;
+    while (events->count < count && smtd_trace_next(&cursor, &event)) {
+        size_t i = events->count++;
+        events->time_ms[i] = (uint32_t) event.time_ms;
+        events->session[i] = event.session;
+        events->keycode[i] = event.keycode;
+        events->position[i] = (uint16_t) (event.row << 8 | event.col);
+        events->pressed[i] = event.pressed;
+    }
+
+    if (cursor.corrupted) {
+        fprintf(stderr, "%s: %s\n", path, smtd_trace_error());
+        smtd_trace_close(&trace);
+        return false;
+    }
+
+    smtd_trace_close(&trace);
+    return true;
+}
+
+typedef struct {
+    uint32_t from;
+    uint32_t to;
+    uint32_t step;
+} batch_range;
+
+static bool parse_range(const char *text, batch_range *range) {
+    char *end;
+    range->from = (uint32_t) strtoul(text, &end, 0);
+    range->to = range->from;
+    range->step = 1;
+    if (*end == ':') range->to = (uint32_t) strtoul(end + 1, &end, 0);
+    if (*end == ':') range->step = (uint32_t) strtoul(end + 1, &end, 0);
+    return *end == '\0' && range->step > 0 && range->from <= range->to;
+}
+
+static size_t range_size(const batch_range *range) {
+    return (range->to - range->from) / range->step + 1;
+}
+
+static double elapsed_s(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - since->tv_sec) + (double) (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-k begin:end] [-t tap] [-q sequence] [-f following_tap] [-r release] [-c] [-s] trace.smtdt\n"
+            "  -k  macro keycodes are strictly between begin and end (default 0x%X:0x%X)\n"
+            "  -t, -q, -f, -r  SMTD_TIMEOUT_* term or from:to[:step] range, all combinations are evaluated\n"
+            "  -c  also run every config through scalar sm_td and compare the decisions\n"
+            "  -s  only print the summary\n"
+            "Prints '<tap> <sequence> <following_tap> <release> <taps> <holds> <digest>' per config.\n",
+            name, SAFE_RANGE, SAFE_RANGE + 0x100);
+}
+
+int main(int argc, char **argv) {
+    batch_range ranges[4] = {
+        {SMTD_GLOBAL_TAP_TERM, SMTD_GLOBAL_TAP_TERM, 1},
+        {SMTD_GLOBAL_SEQUENCE_TERM, SMTD_GLOBAL_SEQUENCE_TERM, 1},
+        {SMTD_GLOBAL_FOLLOWING_TAP_TERM, SMTD_GLOBAL_FOLLOWING_TAP_TERM, 1},
+        {SMTD_GLOBAL_RELEASE_TERM, SMTD_GLOBAL_RELEASE_TERM, 1},
+    };
+    bool check = false;
+    bool summary = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "k:t:q:f:r:csh")) != -1) {
+        switch (option) {
+            case 'k': {
+                long begin, end;
+                if (sscanf(optarg, "%li:%li", &begin, &end) != 2 || begin < 0 || begin >= end || end > 0xFFFF) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                batch_keycodes_begin = (uint16_t) begin;
+                batch_keycodes_end = (uint16_t) end;
+                break;
+            }
+            case 't':
+            case 'q':
+            case 'f':
+            case 'r': {
+                batch_range *range = &ranges[strchr("tqfr", option) - "tqfr"];
+                if (!parse_range(optarg, range)) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            }
+            case 'c':
+                check = true;
+                break;
+            case 's':
+                summary = true;
+                break;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    batch_events events;
+    if (!load_events(argv[optind], &events)) {
+        return 1;
+    }
+
+    size_t count = range_size(&ranges[0]) * range_size(&ranges[1]) * range_size(&ranges[2]) * range_size(&ranges[3]);
+    batch_config *configs = malloc(count * sizeof(*configs));
+    batch_result *results = malloc(count * sizeof(*results));
+    if (!configs || !results) {
+        perror("malloc");
+        return 1;
+    }
+
+    size_t i = 0;
+    for (uint32_t tap = ranges[0].from; tap <= ranges[0].to; tap += ranges[0].step)
+        for (uint32_t sequence = ranges[1].from; sequence <= ranges[1].to; sequence += ranges[1].step)
+            for (uint32_t following_tap = ranges[2].from; following_tap <= ranges[2].to; following_tap += ranges[2].step)
+                for (uint32_t release = ranges[3].from; release <= ranges[3].to; release += ranges[3].step)
+                    configs[i++] = (batch_config) {tap, sequence, following_tap, release};
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    batch_stats stats;
+    batch_run(&events, configs, count, results, &stats);
+    double batch_s = elapsed_s(&started);
+
+    if (!summary) {
+        printf("# tap sequence following_tap release taps holds digest\n");
+        for (i = 0; i < count; i++) {
+            printf("%u %u %u %u %u %u %08x\n", configs[i].tap, configs[i].sequence, configs[i].following_tap,
+                   configs[i].release, results[i].taps, results[i].holds, results[i].digest);
+        }
+    }
+
+    fprintf(stderr, "%zu configs x %zu events in %.3f s: %.0f configs/s, %zu lanes of %d, "
+                    "%zu of %zu lane segments (%.2f%%) run by scalar\n",
+            count, events.count, batch_s, (double) count / batch_s, (count + SMTD_BATCH_LANES - 1) / SMTD_BATCH_LANES,
+            SMTD_BATCH_LANES, stats.scalar_segments, stats.segments,
+            stats.segments ? 100.0 * (double) stats.scalar_segments / (double) stats.segments : 0.0);
+
+    if (!check) {
+        return 0;
+    }
+
+    size_t mismatches = 0;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (i = 0; i < count; i++) {
+        batch_result expected;
+        scalar_run(&events, &configs[i], &expected);
+        if (memcmp(&expected, &results[i], sizeof(expected)) != 0) {
+            if (mismatches++ < 10) {
+                fprintf(stderr, "mismatch at %u %u %u %u: scalar %u taps %u holds %08x, batch %u taps %u holds %08x\n",
+                        configs[i].tap, configs[i].sequence, configs[i].following_tap, configs[i].release,
+                        expected.taps, expected.holds, expected.digest, results[i].taps, results[i].holds,
+                        results[i].digest);
+            }
+        }
+    }
+    double scalar_s = elapsed_s(&started);
+
+    fprintf(stderr, "scalar: %.3f s, %.0f configs/s (batch is %.1fx faster), %zu mismatches\n", scalar_s,
+            (double) count / scalar_s, scalar_s / batch_s, mismatches);
+    return mismatches ? 1 : 0;
+}
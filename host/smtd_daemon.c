@@ -0,0 +1,416 @@
+/* Copyright 2024 Stanislav Markin (https://github.com/stasmarkin)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Userspace remapper: reads key events from an evdev device, runs them through sm_td
+ * and emits the result through uinput. Single-threaded epoll loop, deferred executors
+ * are driven by one timerfd armed to the earliest deadline.
+ *
+ * With -f it reads "<time_ms> <evdev code> <value>" lines from a file or a pipe instead
+ * and writes emitted events in the same format to stdout, using the event timestamps as the clock.
+ * With -t it replays a binary trace (see smtd_trace.h) the same way, straight from the mapped file.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "smtd_host.h"
+#include "smtd_trace.h"
+
+static int uinput_fd = -1;
+static FILE *text_output = NULL;
+static bool realtime = false;
+
+static bool stats_enabled = false;
+static uint64_t stats_events = 0;
+static uint64_t stats_total_ns = 0;
+static uint64_t stats_max_ns = 0;
+
+/* ************************************* *
+ *             HOST DRIVER               *
+ * ************************************* */
+
+static void uinput_write(uint16_t type, uint16_t code, int32_t value) {
+    struct input_event event = {.type = type, .code = code, .value = value};
+    if (write(uinput_fd, &event, sizeof(event)) != sizeof(event)) {
+        perror("uinput write");
+    }
+}
+
+void host_emit_key(uint16_t code, bool pressed) {
+    if (text_output) {
+        fprintf(text_output, "%u %u %d\n", timer_read32(), code, pressed);
+        return;
+    }
+    uinput_write(EV_KEY, code, pressed);
+    uinput_write(EV_SYN, SYN_REPORT, 0);
+}
+
+void host_wait_ms(uint32_t ms) {
+    if (!realtime || ms == 0) {
+        return;
+    }
+    struct timespec delay = {.tv_sec = ms / 1000, .tv_nsec = (long) (ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+static uint32_t monotonic_ms(void) {
+    return (uint32_t) (monotonic_ns() / 1000000ULL);
+}
+
+static void process_key_event(uint32_t now_ms, uint16_t code, int32_t value) {
+    // autorepeat is synthesized by the virtual device itself
+    if (value != 0 && value != 1) {
+        return;
+    }
+
+    uint64_t started = stats_enabled ? monotonic_ns() : 0;
+
+    host_run_deferred(now_ms);
+    host_key_event(code, value == 1);
+
+    if (stats_enabled) {
+        uint64_t spent = monotonic_ns() - started;
+        stats_events++;
+        stats_total_ns += spent;
+        if (spent > stats_max_ns) stats_max_ns = spent;
+    }
+}
+
+static void print_stats(void) {
+    if (!stats_enabled || stats_events == 0) {
+        return;
+    }
+    fprintf(stderr, "events: %llu, avg: %llu ns, max: %llu ns\n", (unsigned long long) stats_events,
+            (unsigned long long) (stats_total_ns / stats_events), (unsigned long long) stats_max_ns);
+}
+
+/* ************************************* *
+ *            FILE/PIPE MODE             *
+ * ************************************* */
+
+static void drain_deferred(void) {
+    // let pending stages time out, as if nothing else was pressed
+    uint32_t deadline;
+    while (host_next_deadline(&deadline)) {
+        host_run_deferred(deadline);
+    }
+}
+
+static int run_text(const char *path) {
+    FILE *input = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!input) {
+        perror(path);
+        return 1;
+    }
+
+    text_output = stdout;
+
+    char line[256];
+    unsigned long line_no = 0;
+    uint32_t now_ms = 0;
+    while (fgets(line, sizeof(line), input)) {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        unsigned long time_ms, code;
+        long value;
+        int fields = sscanf(line, "%lu %lu %ld", &time_ms, &code, &value);
+        if (fields <= 0) continue;
+        if (fields != 3 || code > KEY_MAX) {
+            fprintf(stderr, "%s:%lu: expected '<time_ms> <code> <value>'\n", path, line_no);
+            return 1;
+        }
+
+        now_ms = (uint32_t) time_ms;
+        process_key_event(now_ms, (uint16_t) code, (int32_t) value);
+        fflush(text_output);
+    }
+
+    drain_deferred();
+
+    if (input != stdin) fclose(input);
+    print_stats();
+    return 0;
+}
+
+/* ************************************* *
+ *            TRACE REPLAY MODE          *
+ * ************************************* */
+
+static int run_trace(const char *path, bool by_session, uint32_t session) {
+    smtd_trace trace;
+    if (!smtd_trace_open(&trace, path)) {
+        fprintf(stderr, "%s: %s\n", path, smtd_trace_error());
+        return 1;
+    }
+
+    text_output = stdout;
+
+    smtd_trace_cursor cursor;
+    smtd_trace_cursor_init(&cursor, &trace, by_session ? smtd_trace_seek_session(&trace, session) : 0);
+
+    smtd_trace_event event;
+    bool started = false;
+    uint32_t current_session = 0;
+    while (smtd_trace_next(&cursor, &event)) {
+        if (by_session && event.session != session) break;
+
+        // sessions are independent recordings, nothing should leak from one into another
+        if (started && event.session != current_session) {
+            drain_deferred();
+        }
+        started = true;
+        current_session = event.session;
+
+        // the position is what the keymap is indexed by, see HOST_KEYPOS()
+        uint16_t code = (uint16_t) (event.row << 8 | event.col);
+        if (code > KEY_MAX) continue;
+        process_key_event((uint32_t) event.time_ms, code, event.pressed);
+    }
+
+    // events of a corrupted block can't be trusted, so the replay stops right there
+    if (cursor.corrupted) {
+        fflush(text_output);
+        fprintf(stderr, "%s: %s\n", path, smtd_trace_error());
+        smtd_trace_close(&trace);
+        return 1;
+    }
+
+    drain_deferred();
+    fflush(text_output);
+
+    smtd_trace_close(&trace);
+    print_stats();
+    return 0;
+}
+
+/* ************************************* *
+ *             DEVICE MODE               *
+ * ************************************* */
+
+static int open_uinput(void) {
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        perror("/dev/uinput");
+        return -1;
+    }
+
+    ioctl(fd, UI_SET_EVBIT, EV_SYN);
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(fd, UI_SET_EVBIT, EV_REP);
+    for (int code = 1; code <= KEY_MAX; code++) {
+        ioctl(fd, UI_SET_KEYBIT, code);
+    }
+
+    struct uinput_setup setup = {0};
+    setup.id.bustype = BUS_VIRTUAL;
+    setup.id.vendor = 0x534D;  // "SM"
+    setup.id.product = 0x5444; // "TD"
+    strncpy(setup.name, "sm_td virtual keyboard", UINPUT_MAX_NAME_SIZE - 1);
+
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+        perror("uinput setup");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void arm_timer(int timer_fd) {
+    struct itimerspec spec = {0};
+    uint32_t deadline;
+    if (host_next_deadline(&deadline)) {
+        int32_t delay = (int32_t) (deadline - monotonic_ms());
+        if (delay < 1) delay = 1;
+        spec.it_value.tv_sec = delay / 1000;
+        spec.it_value.tv_nsec = (long) (delay % 1000) * 1000000L;
+    }
+    // zero it_value disarms the timer
+    timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+static int run_device(const char *path, bool grab) {
+    int input_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (input_fd < 0) {
+        perror(path);
+        return 1;
+    }
+
+    // give a chance to release the key that started us, otherwise it gets stuck in the grabbed device
+    usleep(200000);
+    if (grab && ioctl(input_fd, EVIOCGRAB, 1) < 0) {
+        perror("EVIOCGRAB");
+        return 1;
+    }
+
+    uinput_fd = open_uinput();
+    if (uinput_fd < 0) {
+        return 1;
+    }
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || timer_fd < 0 || epoll_fd < 0) {
+        perror("epoll setup");
+        return 1;
+    }
+
+    struct epoll_event watch = {.events = EPOLLIN};
+    watch.data.fd = input_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input_fd, &watch);
+    watch.data.fd = timer_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &watch);
+    watch.data.fd = signal_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &watch);
+
+    realtime = true;
+    bool running = true;
+    while (running) {
+        struct epoll_event ready[3];
+        int count = epoll_wait(epoll_fd, ready, 3, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            int fd = ready[i].data.fd;
+
+            if (fd == input_fd) {
+                struct input_event events[64];
+                ssize_t size;
+                while ((size = read(input_fd, events, sizeof(events))) > 0) {
+                    for (size_t j = 0; j < (size_t) size / sizeof(events[0]); j++) {
+                        if (events[j].type != EV_KEY) continue;
+                        process_key_event(monotonic_ms(), events[j].code, events[j].value);
+                    }
+                }
+                if (size < 0 && errno != EAGAIN) {
+                    perror(path);
+                    running = false;
+                }
+            } else if (fd == timer_fd) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                    perror("timerfd");
+                }
+                host_run_deferred(monotonic_ms());
+            } else if (fd == signal_fd) {
+                running = false;
+            }
+        }
+
+        arm_timer(timer_fd);
+    }
+
+    if (grab) ioctl(input_fd, EVIOCGRAB, 0);
+    ioctl(uinput_fd, UI_DEV_DESTROY);
+    close(uinput_fd);
+    close(input_fd);
+    print_stats();
+    return 0;
+}
+
+/* ************************************* *
+ *                 MAIN                  *
+ * ************************************* */
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-n] [-s] /dev/input/eventX\n"
+            "       %s [-s] -f <events file | ->\n"
+            "       %s [-s] [-S session] -t <trace file>\n"
+            "  -f  read '<time_ms> <code> <value>' lines and print emitted events to stdout\n"
+            "  -t  replay a binary trace and print emitted events to stdout\n"
+            "  -S  replay only this session of the trace\n"
+            "  -n  don't grab the input device\n"
+            "  -s  print processing time per event on exit\n",
+            name, name, name);
+}
+
+int main(int argc, char **argv) {
+    const char *text_path = NULL;
+    const char *trace_path = NULL;
+    bool by_session = false;
+    uint32_t session = 0;
+    bool grab = true;
+
+    int option;
+    while ((option = getopt(argc, argv, "f:t:S:nsh")) != -1) {
+        switch (option) {
+            case 'f':
+                text_path = optarg;
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'S':
+                by_session = true;
+                session = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                grab = false;
+                break;
+            case 's':
+                stats_enabled = true;
+                break;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? 0 : 2;
+        }
+    }
+
+    if (text_path) {
+        return run_text(text_path);
+    }
+    if (trace_path) {
+        return run_trace(trace_path, by_session, session);
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    return run_device(argv[optind], grab);
+}
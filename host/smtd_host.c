@@ -0,0 +1,342 @@
+/* Copyright 2024 Stanislav Markin (https://github.com/stasmarkin)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host implementation of the QMK calls used by sm_td: clock, deferred executors,
+ * mods and keyboard report, layers and keycode resolution.
+ */
+
+#include "smtd_host.h"
+#include "deferred_exec.h"
+
+/* ************************************* *
+ *                CLOCK                  *
+ * ************************************* */
+
+static uint32_t host_now_ms = 0;
+
+void host_set_time(uint32_t now_ms) {
+    host_now_ms = now_ms;
+}
+
+uint16_t timer_read(void) {
+    return (uint16_t) host_now_ms;
+}
+
+uint32_t timer_read32(void) {
+    return host_now_ms;
+}
+
+uint16_t timer_elapsed(uint16_t last) {
+    return (uint16_t) (host_now_ms - last);
+}
+
+uint32_t timer_elapsed32(uint32_t last) {
+    return host_now_ms - last;
+}
+
+/* ************************************* *
+ *          DEFERRED EXECUTORS           *
+ * ************************************* */
+
+typedef struct {
+    deferred_token token;
+    uint32_t trigger_time;
+    deferred_exec_callback callback;
+    void *cb_arg;
+} host_deferred_executor;
+
+static host_deferred_executor host_executors[MAX_DEFERRED_EXECUTORS];
+static deferred_token host_last_token = INVALID_DEFERRED_TOKEN;
+
+deferred_token defer_exec(uint32_t delay_ms, deferred_exec_callback callback, void *cb_arg) {
+    // same as QMK, zero delay is not scheduled
+    if (delay_ms == 0 || !callback) {
+        return INVALID_DEFERRED_TOKEN;
+    }
+
+    for (uint8_t i = 0; i < MAX_DEFERRED_EXECUTORS; i++) {
+        host_deferred_executor *executor = &host_executors[i];
+        if (executor->token != INVALID_DEFERRED_TOKEN) continue;
+
+        host_last_token++;
+        if (host_last_token == INVALID_DEFERRED_TOKEN) host_last_token++;
+
+        executor->token = host_last_token;
+        executor->trigger_time = host_now_ms + delay_ms;
+        executor->callback = callback;
+        executor->cb_arg = cb_arg;
+        return executor->token;
+    }
+
+    return INVALID_DEFERRED_TOKEN;
+}
+
+bool extend_deferred_exec(deferred_token token, uint32_t delay_ms) {
+    for (uint8_t i = 0; token != INVALID_DEFERRED_TOKEN && i < MAX_DEFERRED_EXECUTORS; i++) {
+        if (host_executors[i].token == token) {
+            host_executors[i].trigger_time = host_now_ms + delay_ms;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool cancel_deferred_exec(deferred_token token) {
+    for (uint8_t i = 0; token != INVALID_DEFERRED_TOKEN && i < MAX_DEFERRED_EXECUTORS; i++) {
+        if (host_executors[i].token == token) {
+            host_executors[i].token = INVALID_DEFERRED_TOKEN;
+            return true;
+        }
+    }
+    return false;
+}
+
+static host_deferred_executor *host_earliest_executor(void) {
+    host_deferred_executor *earliest = NULL;
+    for (uint8_t i = 0; i < MAX_DEFERRED_EXECUTORS; i++) {
+        host_deferred_executor *executor = &host_executors[i];
+        if (executor->token == INVALID_DEFERRED_TOKEN) continue;
+        if (!earliest || (int32_t) (executor->trigger_time - earliest->trigger_time) < 0) {
+            earliest = executor;
+        }
+    }
+    return earliest;
+}
+
+bool host_next_deadline(uint32_t *deadline_ms) {
+    host_deferred_executor *earliest = host_earliest_executor();
+    if (!earliest) {
+        return false;
+    }
+    *deadline_ms = earliest->trigger_time;
+    return true;
+}
+
+void host_run_deferred(uint32_t now_ms) {
+    for (;;) {
+        host_deferred_executor *executor = host_earliest_executor();
+        if (!executor || (int32_t) (executor->trigger_time - now_ms) > 0) break;
+
+        // callbacks see the clock at their trigger time, so anything they schedule is relative to it
+        host_now_ms = executor->trigger_time;
+        deferred_token token = executor->token;
+        uint32_t next = executor->callback(executor->trigger_time, executor->cb_arg);
+
+        // the callback might have cancelled itself or the slot might have been reused
+        if (executor->token != token) continue;
+        if (next == 0) {
+            executor->token = INVALID_DEFERRED_TOKEN;
+        } else {
+            executor->trigger_time += next;
+        }
+    }
+    host_now_ms = now_ms;
+}
+
+/* ************************************* *
+ *         MODS & KEYBOARD REPORT        *
+ * ************************************* */
+
+static const uint16_t host_mod_codes[8] = {
+    KEY_LEFTCTRL, KEY_LEFTSHIFT, KEY_LEFTALT, KEY_LEFTMETA,
+    KEY_RIGHTCTRL, KEY_RIGHTSHIFT, KEY_RIGHTALT, KEY_RIGHTMETA,
+};
+
+static uint8_t host_mods = 0;
+static uint8_t host_sent_mods = 0;
+
+/** Keys currently down on the OS side, like a keyboard report, so repeated (un)registers are not sent twice */
+static uint8_t host_sent_keys[(KEY_CNT + 7) / 8];
+
+static void host_send_key(uint16_t code, bool pressed) {
+    uint8_t bit = 1 << (code % 8);
+    if (!(host_sent_keys[code / 8] & bit) == !pressed) {
+        return;
+    }
+    host_sent_keys[code / 8] ^= bit;
+    host_emit_key(code, pressed);
+}
+
+uint8_t smtd_host_mod_bit(uint16_t code) {
+    for (uint8_t i = 0; i < 8; i++) {
+        if (host_mod_codes[i] == code) return 1 << i;
+    }
+    return 0;
+}
+
+uint8_t get_mods(void) {
+    return host_mods;
+}
+
+void set_mods(uint8_t mods) {
+    host_mods = mods;
+}
+
+void add_mods(uint8_t mods) {
+    host_mods |= mods;
+}
+
+void del_mods(uint8_t mods) {
+    host_mods &= ~mods;
+}
+
+void clear_mods(void) {
+    host_mods = 0;
+}
+
+void register_mods(uint8_t mods) {
+    add_mods(mods);
+    send_keyboard_report();
+}
+
+void unregister_mods(uint8_t mods) {
+    del_mods(mods);
+    send_keyboard_report();
+}
+
+void send_keyboard_report(void) {
+    // an OS keyboard has no report, so mods are sent as modifier key events
+    uint8_t diff = host_mods ^ host_sent_mods;
+    for (uint8_t i = 0; i < 8; i++) {
+        if (diff & (1 << i)) {
+            host_send_key(host_mod_codes[i], host_mods & (1 << i));
+        }
+    }
+    host_sent_mods = host_mods;
+}
+
+void register_code16(uint16_t code) {
+    uint8_t mod = smtd_host_mod_bit(code);
+    if (mod) {
+        register_mods(mod);
+        return;
+    }
+    send_keyboard_report();
+    if (code != KC_NO && code <= KEY_MAX) {
+        host_send_key(code, true);
+    }
+}
+
+void unregister_code16(uint16_t code) {
+    uint8_t mod = smtd_host_mod_bit(code);
+    if (mod) {
+        unregister_mods(mod);
+        return;
+    }
+    if (code != KC_NO && code <= KEY_MAX) {
+        host_send_key(code, false);
+    }
+}
+
+void tap_code16(uint16_t code) {
+    register_code16(code);
+    unregister_code16(code);
+}
+
+void register_code(uint8_t code) {
+    register_code16(code);
+}
+
+void unregister_code(uint8_t code) {
+    unregister_code16(code);
+}
+
+void tap_code(uint8_t code) {
+    tap_code16(code);
+}
+
+void wait_ms(uint32_t ms) {
+    host_wait_ms(ms);
+}
+
+/* ************************************* *
+ *               LAYERS                  *
+ * ************************************* */
+
+layer_state_t layer_state = 0;
+
+uint8_t get_highest_layer(layer_state_t state) {
+    for (int8_t layer = 31; layer > 0; layer--) {
+        if (state & ((layer_state_t) 1 << layer)) return layer;
+    }
+    return 0;
+}
+
+void layer_move(uint8_t layer) {
+    layer_state = (layer_state_t) 1 << layer;
+}
+
+void layer_on(uint8_t layer) {
+    layer_state |= (layer_state_t) 1 << layer;
+}
+
+void layer_off(uint8_t layer) {
+    layer_state &= ~((layer_state_t) 1 << layer);
+}
+
+bool layer_state_is(uint8_t layer) {
+    return get_highest_layer(layer_state) == layer;
+}
+
+/* ************************************* *
+ *           RECORD PROCESSING           *
+ * ************************************* */
+
+/** Keycodes resolved on press, so the release goes to the same keycode even if the layer has changed */
+static uint16_t host_pressed_keycodes[KEY_CNT];
+
+static uint16_t host_resolve_keycode(uint16_t code) {
+    for (int8_t layer = keymaps_layers - 1; layer >= 0; layer--) {
+        if (layer > 0 && !(layer_state & ((layer_state_t) 1 << layer))) continue;
+
+        uint16_t keycode = keymaps[layer][code];
+        if (keycode != KC_TRANSPARENT) return keycode;
+    }
+    return code;
+}
+
+void process_record(keyrecord_t *record) {
+    uint16_t code = HOST_KEYPOS_CODE(record->event.key);
+    if (code > KEY_MAX) {
+        return;
+    }
+
+    uint16_t keycode;
+    if (record->event.pressed) {
+        keycode = host_resolve_keycode(code);
+        host_pressed_keycodes[code] = keycode;
+    } else {
+        keycode = host_pressed_keycodes[code];
+        if (keycode == KC_TRANSPARENT) keycode = host_resolve_keycode(code);
+        host_pressed_keycodes[code] = KC_TRANSPARENT;
+    }
+
+    if (!process_record_user(keycode, record)) {
+        return;
+    }
+
+    if (record->event.pressed) {
+        register_code16(keycode);
+    } else {
+        unregister_code16(keycode);
+    }
+}
+
+void host_key_event(uint16_t code, bool pressed) {
+    keyrecord_t record = {.event = MAKE_KEYEVENT(code >> 8, code & 0xFF, pressed)};
+    process_record(&record);
+}
@@ -0,0 +1,143 @@
+/* Copyright 2024 Stanislav Markin (https://github.com/stasmarkin)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * Stand-in for QMK_KEYBOARD_H, so sm_td.h can run on a Linux host.
+ *
+ * Keycodes are evdev KEY_* codes, custom keycodes start from SAFE_RANGE.
+ * Key positions are evdev codes too: row is the high byte and col is the low byte of the code.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <linux/input-event-codes.h>
+
+#include "timer.h"
+
+/* ************************************* *
+ *          KEYCODES & POSITIONS         *
+ * ************************************* */
+
+#ifndef TAPPING_TERM
+#define TAPPING_TERM 200
+#endif
+
+#define SAFE_RANGE 0x7E00
+
+/** Not set keymap entries are transparent, on the base layer they fall back to the key itself */
+#define KC_TRANSPARENT 0
+#define KC_TRNS KC_TRANSPARENT
+
+/** Disabled key, never emitted */
+#define KC_NO 0x7DFF
+
+typedef struct {
+    uint8_t col;
+    uint8_t row;
+} keypos_t;
+
+typedef struct {
+    keypos_t key;
+    bool pressed;
+    uint16_t time;
+} keyevent_t;
+
+typedef struct {
+    keyevent_t event;
+} keyrecord_t;
+
+#define MAKE_KEYPOS(row_num, col_num) ((keypos_t){.row = (row_num), .col = (col_num)})
+#define MAKE_KEYEVENT(row_num, col_num, press) \
+    ((keyevent_t){.key = MAKE_KEYPOS((row_num), (col_num)), .pressed = (press), .time = timer_read()})
+
+#define HOST_KEYPOS(code) MAKE_KEYPOS((code) >> 8, (code) & 0xFF)
+#define HOST_KEYPOS_CODE(pos) ((uint16_t) (((pos).row << 8) | (pos).col))
+
+/** Defined by the keymap: layers of KEY_CNT keycodes indexed by evdev code */
+extern const uint16_t keymaps[][KEY_CNT];
+extern const uint8_t keymaps_layers;
+
+/** Defined by the keymap, same as in QMK */
+bool process_record_user(uint16_t keycode, keyrecord_t *record);
+
+void process_record(keyrecord_t *record);
+
+/* ************************************* *
+ *              MODIFIERS                *
+ * ************************************* */
+
+uint8_t smtd_host_mod_bit(uint16_t code);
+
+#define MOD_BIT(code) smtd_host_mod_bit(code)
+
+uint8_t get_mods(void);
+void set_mods(uint8_t mods);
+void add_mods(uint8_t mods);
+void del_mods(uint8_t mods);
+void clear_mods(void);
+void register_mods(uint8_t mods);
+void unregister_mods(uint8_t mods);
+
+/* ************************************* *
+ *           KEYBOARD REPORT             *
+ * ************************************* */
+
+void send_keyboard_report(void);
+void register_code(uint8_t code);
+void unregister_code(uint8_t code);
+void tap_code(uint8_t code);
+void register_code16(uint16_t code);
+void unregister_code16(uint16_t code);
+void tap_code16(uint16_t code);
+void wait_ms(uint32_t ms);
+
+/* ************************************* *
+ *               LAYERS                  *
+ * ************************************* */
+
+typedef uint32_t layer_state_t;
+
+extern layer_state_t layer_state;
+
+uint8_t get_highest_layer(layer_state_t state);
+void layer_move(uint8_t layer);
+void layer_on(uint8_t layer);
+void layer_off(uint8_t layer);
+bool layer_state_is(uint8_t layer);
+
+/* ************************************* *
+ *       HOST DRIVER INTERFACE           *
+ * ************************************* */
+
+/** Implemented by the driver (daemon): emits a key event to the OS */
+void host_emit_key(uint16_t code, bool pressed);
+
+/** Implemented by the driver: blocks for simultaneous presses delay, may be a no-op for replays */
+void host_wait_ms(uint32_t ms);
+
+/** Sets the clock seen by timer_read() and defer_exec() */
+void host_set_time(uint32_t now_ms);
+
+/** Runs all deferred callbacks due at `now_ms` (inclusive) in trigger order, then sets the clock to `now_ms` */
+void host_run_deferred(uint32_t now_ms);
+
+/** Returns true and the earliest trigger time if any deferred callback is scheduled */
+bool host_next_deadline(uint32_t *deadline_ms);
+
+/** Feeds a physical key event at the current time */
+void host_key_event(uint16_t code, bool pressed);
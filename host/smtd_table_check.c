@@ -0,0 +1,201 @@
+/* Copyright 2024 Stanislav Markin (https://github.com/stasmarkin)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Static checks of the sm_td stage transitions table (smtd_transitions):
+ * - every transition ends with SMTD_OP_PASS or SMTD_OP_HANDLED within SMTD_TRANSITION_OPS ops
+ * - every op is known
+ * - after SMTD_OP_STAGE_NONE the state is released and may be reused, so only ops that don't touch it follow
+ * - SMTD_OP_REPLAY comes only after the state is released
+ * - every stage is entered by some transition and has a way out
+ * - every stage smtd_next_stage() schedules a timeout for has a TIMEOUT transition, or the state would hang in it
+ * - TIMEOUT transitions run without a key record, so they don't use the event key
+ * With -v it prints the table. Exits with 1 if anything is wrong.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtd_host.h"
+
+enum custom_keycodes {
+    SMTD_KEYCODES_BEGIN = SAFE_RANGE,
+    SMTD_KEYCODES_END,
+};
+
+#include "sm_td.h"
+
+// the table is checked as is, nothing is run, but sm_td.h and smtd_host.c still need a keymap to link
+
+const uint16_t keymaps[][KEY_CNT] = {{0}};
+const uint8_t keymaps_layers = 1;
+
+bool process_record_user(uint16_t keycode, keyrecord_t *record) {
+    return process_smtd(keycode, record);
+}
+
+void on_smtd_action(uint16_t keycode, smtd_action action, uint8_t tap_count) {}
+
+void host_emit_key(uint16_t code, bool pressed) {}
+
+void host_wait_ms(uint32_t ms) {}
+
+static const char *stage_names[] = {
+    "NONE", "TOUCH", "SEQUENCE", "FOLLOWING_TOUCH", "HOLD", "RELEASE",
+};
+
+static const char *event_names[] = {
+    "MACRO_PRESS", "MACRO_RELEASE", "FOLLOWING_PRESS", "FOLLOWING_RELEASE", "OTHER_PRESS", "OTHER_RELEASE",
+    "TIMEOUT",
+};
+
+static const char *op_names[] = {
+    "PASS", "HANDLED",
+    "STAGE_NONE", "STAGE_TOUCH", "STAGE_SEQUENCE", "STAGE_FOLLOWING_TOUCH", "STAGE_HOLD", "STAGE_RELEASE",
+    "TAP", "TAP_IF_AGGREGATE", "TAP_IF_NOT_AGGREGATE", "ACTION_HOLD", "ACTION_RELEASE",
+    "SEQUENCE_INC", "SEQUENCE_RESET", "DELAY",
+    "SAVE_FOLLOWING", "SPECULATE_FOLLOWING", "PRESS_FOLLOWING", "TAP_FOLLOWING", "REPLAY_FROZEN", "REPLAY",
+};
+
+#define NAMES_COUNT(names) (sizeof(names) / sizeof(names[0]))
+_Static_assert(NAMES_COUNT(stage_names) == SMTD_STAGES_COUNT, "stage_names is out of sync with smtd_stage");
+_Static_assert(NAMES_COUNT(event_names) == SMTD_EVENTS_COUNT, "event_names is out of sync with smtd_event");
+_Static_assert(NAMES_COUNT(op_names) == SMTD_OPS_COUNT, "op_names is out of sync with smtd_op");
+
+/** Stages smtd_next_stage() schedules a timeout for, must be in sync with it */
+static const smtd_stage timed_stages[] = {
+    SMTD_STAGE_TOUCH, SMTD_STAGE_SEQUENCE, SMTD_STAGE_FOLLOWING_TOUCH, SMTD_STAGE_RELEASE,
+};
+
+static int errors = 0;
+
+static void report(int stage, int event, int position, const char *message) {
+    fprintf(stderr, "%s/%s op %d: %s\n", stage_names[stage], event_names[event], position, message);
+    errors++;
+}
+
+static bool is_stage_op(uint8_t op) {
+    return op >= SMTD_OP_STAGE_NONE && op <= SMTD_OP_STAGE_RELEASE;
+}
+
+/** Ops that don't read or write the state, so they may follow SMTD_OP_STAGE_NONE */
+static bool is_stateless_op(uint8_t op) {
+    return op == SMTD_OP_PASS || op == SMTD_OP_HANDLED || op == SMTD_OP_DELAY || op == SMTD_OP_REPLAY;
+}
+
+/** Ops that read the event key, the record is NULL on SMTD_EVENT_TIMEOUT */
+static bool is_record_op(uint8_t op) {
+    return op == SMTD_OP_SAVE_FOLLOWING || op == SMTD_OP_REPLAY_FROZEN || op == SMTD_OP_REPLAY;
+}
+
+static void check_transition(int stage, int event, bool entered[SMTD_STAGES_COUNT], bool *has_exit) {
+    const uint8_t *ops = smtd_transitions[stage][event];
+    bool released = false;
+
+    for (int i = 0; i < SMTD_TRANSITION_OPS; i++) {
+        uint8_t op = ops[i];
+        if (op >= SMTD_OPS_COUNT) {
+            report(stage, event, i, "unknown op");
+            continue;
+        }
+        if (released && !is_stateless_op(op)) {
+            fprintf(stderr, "%s/%s op %d: %s uses the state after STAGE_NONE\n",
+                    stage_names[stage], event_names[event], i, op_names[op]);
+            errors++;
+        }
+        if (event == SMTD_EVENT_TIMEOUT && is_record_op(op)) {
+            fprintf(stderr, "%s/%s op %d: %s needs the event key, there is none on timeout\n",
+                    stage_names[stage], event_names[event], i, op_names[op]);
+            errors++;
+        }
+        if (op == SMTD_OP_REPLAY && !released) {
+            report(stage, event, i, "REPLAY before the state is released, use REPLAY_FROZEN");
+        }
+        if (is_stage_op(op)) {
+            entered[op - SMTD_OP_STAGE_NONE] = true;
+            if (op - SMTD_OP_STAGE_NONE != stage) *has_exit = true;
+            if (op == SMTD_OP_STAGE_NONE) released = true;
+        }
+        if (op == SMTD_OP_PASS || op == SMTD_OP_HANDLED) {
+            return;
+        }
+    }
+    report(stage, event, SMTD_TRANSITION_OPS - 1, "not terminated with PASS or HANDLED");
+}
+
+static void print_table(void) {
+    for (int stage = 0; stage < SMTD_STAGES_COUNT; stage++) {
+        for (int event = 0; event < SMTD_EVENTS_COUNT; event++) {
+            const uint8_t *ops = smtd_transitions[stage][event];
+            if (ops[0] == SMTD_OP_PASS) continue;
+
+            printf("%-16s %-18s", stage_names[stage], event_names[event]);
+            for (int i = 0; i < SMTD_TRANSITION_OPS; i++) {
+                printf(" %s", ops[i] < SMTD_OPS_COUNT ? op_names[ops[i]] : "?");
+                if (ops[i] == SMTD_OP_PASS || ops[i] == SMTD_OP_HANDLED) break;
+            }
+            printf("\n");
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    bool verbose = false;
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        if (opt != 'v') {
+            fprintf(stderr, "usage: smtd-table-check [-v]\n");
+            return 2;
+        }
+        verbose = true;
+    }
+
+    bool entered[SMTD_STAGES_COUNT] = {[SMTD_STAGE_NONE] = true};
+    bool has_exit[SMTD_STAGES_COUNT] = {false};
+    for (int stage = 0; stage < SMTD_STAGES_COUNT; stage++) {
+        for (int event = 0; event < SMTD_EVENTS_COUNT; event++) {
+            check_transition(stage, event, entered, &has_exit[stage]);
+        }
+    }
+
+    for (int stage = 0; stage < SMTD_STAGES_COUNT; stage++) {
+        if (!entered[stage]) {
+            fprintf(stderr, "%s: unreachable, no transition enters it\n", stage_names[stage]);
+            errors++;
+        }
+        if (!has_exit[stage]) {
+            fprintf(stderr, "%s: no transition leaves it\n", stage_names[stage]);
+            errors++;
+        }
+    }
+
+    for (int i = 0; i < (int) NAMES_COUNT(timed_stages); i++) {
+        smtd_stage stage = timed_stages[i];
+        if (smtd_transitions[stage][SMTD_EVENT_TIMEOUT][0] == SMTD_OP_PASS) {
+            fprintf(stderr, "%s: has a timeout but no TIMEOUT transition, the state would hang\n",
+                    stage_names[stage]);
+            errors++;
+        }
+    }
+
+    if (verbose) {
+        print_table();
+    }
+    printf("%s: %d stages, %d events, %d problems\n", errors ? "FAIL" : "ok", SMTD_STAGES_COUNT,
+           SMTD_EVENTS_COUNT, errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,373 @@
+/* Copyright 2024 Stanislav Markin (https://github.com/stasmarkin)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "smtd_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static char trace_error[256] = "";
+
+static bool fail(const char *message) {
+    snprintf(trace_error, sizeof(trace_error), "%s", message);
+    return false;
+}
+
+static bool fail_errno(const char *message) {
+    snprintf(trace_error, sizeof(trace_error), "%s: %s", message, strerror(errno));
+    return false;
+}
+
+const char *smtd_trace_error(void) {
+    return trace_error;
+}
+
+/* ************************************* *
+ *               LAYOUT                  *
+ * ************************************* */
+
+static size_t align8(size_t size) {
+    return (size + 7) & ~(size_t) 7;
+}
+
+static size_t columns_size(uint32_t events_count) {
+    return align8((size_t) events_count * (2 + 2 + 1 + 1) + (events_count + 7) / 8);
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size) {
+    static uint32_t table[256];
+    static bool table_ready = false;
+    if (!table_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        table_ready = true;
+    }
+
+    uint32_t crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFU;
+}
+
+/* ************************************* *
+ *                WRITER                 *
+ * ************************************* */
+
+static bool write_all(smtd_trace_writer *writer, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    while (size > 0) {
+        ssize_t written = write(writer->fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return fail_errno("write");
+        }
+        bytes += written;
+        size -= (size_t) written;
+        writer->offset += (uint64_t) written;
+    }
+    return true;
+}
+
+static void lay_out_columns(smtd_trace_writer *writer, uint32_t events_count) {
+    uint8_t *base = (uint8_t *) writer->time_delta;
+    writer->keycode = (uint16_t *) (base + (size_t) events_count * 2);
+    writer->row = base + (size_t) events_count * 4;
+    writer->col = base + (size_t) events_count * 5;
+    writer->pressed = base + (size_t) events_count * 6;
+}
+
+bool smtd_trace_writer_open(smtd_trace_writer *writer, const char *path, uint32_t block_capacity) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+    if (block_capacity == 0) block_capacity = SMTD_TRACE_DEFAULT_BLOCK_CAPACITY;
+    writer->block_capacity = block_capacity;
+
+    // while a block is being filled, columns are laid out for the full capacity and packed on flush
+    uint8_t *columns = calloc(1, columns_size(block_capacity));
+    if (!columns) return fail_errno("calloc");
+    writer->time_delta = (uint16_t *) columns;
+    lay_out_columns(writer, block_capacity);
+
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd < 0) {
+        free(columns);
+        return fail_errno(path);
+    }
+
+    // header is rewritten on close, when the index location is known
+    smtd_trace_header header = {0};
+    return write_all(writer, &header, sizeof(header));
+}
+
+static bool flush_block(smtd_trace_writer *writer) {
+    uint32_t count = writer->block.events_count;
+    if (count == 0) return true;
+
+    // columns were filled with capacity strides, pack them for the actual count
+    uint8_t *base = (uint8_t *) writer->time_delta;
+    uint32_t capacity = writer->block_capacity;
+    memmove(base + (size_t) count * 2, base + (size_t) capacity * 2, (size_t) count * 2);
+    memmove(base + (size_t) count * 4, base + (size_t) capacity * 4, count);
+    memmove(base + (size_t) count * 5, base + (size_t) capacity * 5, count);
+    memmove(base + (size_t) count * 6, base + (size_t) capacity * 6, (count + 7) / 8);
+    size_t data_size = columns_size(count);
+    memset(base + (size_t) count * 6 + (count + 7) / 8, 0, data_size - ((size_t) count * 6 + (count + 7) / 8));
+
+    writer->block.data_size = (uint32_t) data_size;
+    writer->block.checksum = crc32(base, data_size);
+
+    if (writer->blocks_count == writer->index_capacity) {
+        uint32_t capacity_next = writer->index_capacity ? writer->index_capacity * 2 : 64;
+        smtd_trace_index_entry *index = realloc(writer->index, capacity_next * sizeof(*index));
+        if (!index) return fail_errno("realloc");
+        writer->index = index;
+        writer->index_capacity = capacity_next;
+    }
+    writer->index[writer->blocks_count++] = (smtd_trace_index_entry){
+        .first_time_ms = writer->block.base_time_ms,
+        .offset = writer->offset,
+        .session = writer->block.session,
+        .events_count = count,
+    };
+
+    if (!write_all(writer, &writer->block, sizeof(writer->block))) return false;
+    if (!write_all(writer, base, data_size)) return false;
+
+    memset(base, 0, columns_size(capacity));
+    writer->block.events_count = 0;
+    return true;
+}
+
+bool smtd_trace_write(smtd_trace_writer *writer, const smtd_trace_event *event) {
+    smtd_trace_block *block = &writer->block;
+
+    if (writer->events_count > 0) {
+        if (event->time_ms < writer->last_time_ms) return fail("events must be ordered by time");
+        if (event->session < block->session) return fail("events must be ordered by session");
+    }
+
+    if (block->events_count > 0 && (block->events_count == writer->block_capacity
+                                    || block->session != event->session
+                                    || event->time_ms - writer->last_time_ms > UINT16_MAX)) {
+        if (!flush_block(writer)) return false;
+    }
+
+    if (block->events_count == 0) {
+        block->base_time_ms = event->time_ms;
+        block->session = event->session;
+        writer->last_time_ms = event->time_ms;
+    }
+
+    uint32_t i = block->events_count++;
+    writer->time_delta[i] = (uint16_t) (event->time_ms - writer->last_time_ms);
+    writer->keycode[i] = event->keycode;
+    writer->row[i] = event->row;
+    writer->col[i] = event->col;
+    if (event->pressed) writer->pressed[i / 8] |= (uint8_t) (1 << (i % 8));
+
+    writer->last_time_ms = event->time_ms;
+    writer->events_count++;
+    return true;
+}
+
+bool smtd_trace_writer_close(smtd_trace_writer *writer) {
+    bool ok = flush_block(writer);
+
+    smtd_trace_header header = {
+        .version = SMTD_TRACE_VERSION,
+        .block_capacity = writer->block_capacity,
+        .events_count = writer->events_count,
+        .index_offset = writer->offset,
+        .blocks_count = writer->blocks_count,
+    };
+    memcpy(header.magic, SMTD_TRACE_MAGIC, sizeof(header.magic));
+
+    ok = ok && write_all(writer, writer->index, (size_t) writer->blocks_count * sizeof(*writer->index));
+    if (ok && pwrite(writer->fd, &header, sizeof(header), 0) != sizeof(header)) ok = fail_errno("pwrite");
+    if (close(writer->fd) < 0 && ok) ok = fail_errno("close");
+
+    free(writer->time_delta);
+    free(writer->index);
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+    return ok;
+}
+
+/* ************************************* *
+ *                READER                 *
+ * ************************************* */
+
+bool smtd_trace_open(smtd_trace *trace, const char *path) {
+    memset(trace, 0, sizeof(*trace));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return fail_errno(path);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return fail_errno(path);
+    }
+    if ((size_t) st.st_size < sizeof(smtd_trace_header)) {
+        close(fd);
+        return fail("not a sm_td trace: file is too short");
+    }
+
+    void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return fail_errno("mmap");
+    madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+    trace->data = data;
+    trace->size = (size_t) st.st_size;
+    trace->header = (const smtd_trace_header *) trace->data;
+
+    const smtd_trace_header *header = trace->header;
+    if (memcmp(header->magic, SMTD_TRACE_MAGIC, sizeof(header->magic)) != 0) {
+        smtd_trace_close(trace);
+        return fail("not a sm_td trace: bad magic");
+    }
+    if (header->version != SMTD_TRACE_VERSION) {
+        smtd_trace_close(trace);
+        return fail("unsupported sm_td trace version");
+    }
+    if (header->index_offset % 8 != 0 || header->index_offset > trace->size
+        || (trace->size - header->index_offset) / sizeof(smtd_trace_index_entry) < header->blocks_count) {
+        smtd_trace_close(trace);
+        return fail("corrupted sm_td trace: bad index location");
+    }
+    trace->index = (const smtd_trace_index_entry *) (trace->data + header->index_offset);
+
+    // bounds are checked once here, so the cursor can read columns without any checks
+    for (uint32_t i = 0; i < header->blocks_count; i++) {
+        const smtd_trace_index_entry *entry = &trace->index[i];
+        // offsets come from the file, so they are only subtracted from to never wrap around
+        if (entry->offset % 8 != 0 || entry->offset > header->index_offset
+            || header->index_offset - entry->offset < sizeof(smtd_trace_block)) {
+            smtd_trace_close(trace);
+            return fail("corrupted sm_td trace: bad block offset");
+        }
+        const smtd_trace_block *block = smtd_trace_get_block(trace, i);
+        if (block->events_count != entry->events_count || block->events_count > header->block_capacity
+            || block->data_size < columns_size(block->events_count)
+            || block->data_size > header->index_offset - entry->offset - sizeof(smtd_trace_block)) {
+            smtd_trace_close(trace);
+            return fail("corrupted sm_td trace: bad block header");
+        }
+    }
+    return true;
+}
+
+void smtd_trace_close(smtd_trace *trace) {
+    if (trace->data) munmap((void *) trace->data, trace->size);
+    memset(trace, 0, sizeof(*trace));
+}
+
+const smtd_trace_block *smtd_trace_get_block(const smtd_trace *trace, uint32_t block) {
+    return (const smtd_trace_block *) (trace->data + trace->index[block].offset);
+}
+
+bool smtd_trace_block_valid(const smtd_trace *trace, uint32_t block) {
+    const smtd_trace_block *header = smtd_trace_get_block(trace, block);
+    return crc32((const uint8_t *) (header + 1), header->data_size) == header->checksum;
+}
+
+uint32_t smtd_trace_seek_time(const smtd_trace *trace, uint64_t time_ms) {
+    // first block starting at or after time_ms, events at time_ms may still end the block before it
+    uint32_t low = 0, high = trace->header->blocks_count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (trace->index[middle].first_time_ms < time_ms) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low > 0 ? low - 1 : 0;
+}
+
+uint32_t smtd_trace_seek_session(const smtd_trace *trace, uint32_t session) {
+    uint32_t low = 0, high = trace->header->blocks_count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (trace->index[middle].session < session) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static void cursor_enter_block(smtd_trace_cursor *cursor) {
+    cursor->position = 0;
+    cursor->header = NULL;
+    if (cursor->block >= cursor->trace->header->blocks_count) return;
+
+    const smtd_trace_block *header = smtd_trace_get_block(cursor->trace, cursor->block);
+    if (!smtd_trace_block_valid(cursor->trace, cursor->block)) {
+        snprintf(trace_error, sizeof(trace_error), "block %u: checksum mismatch", cursor->block);
+        cursor->corrupted = true;
+        return;
+    }
+
+    const uint8_t *base = (const uint8_t *) (header + 1);
+    uint32_t count = header->events_count;
+
+    cursor->header = header;
+    cursor->time_ms = header->base_time_ms;
+    cursor->time_delta = (const uint16_t *) base;
+    cursor->keycode = (const uint16_t *) (base + (size_t) count * 2);
+    cursor->row = base + (size_t) count * 4;
+    cursor->col = base + (size_t) count * 5;
+    cursor->pressed = base + (size_t) count * 6;
+}
+
+void smtd_trace_cursor_init(smtd_trace_cursor *cursor, const smtd_trace *trace, uint32_t block) {
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->trace = trace;
+    cursor->block = block;
+    cursor_enter_block(cursor);
+}
+
+bool smtd_trace_next(smtd_trace_cursor *cursor, smtd_trace_event *event) {
+    while (cursor->header && cursor->position == cursor->header->events_count) {
+        cursor->block++;
+        cursor_enter_block(cursor);
+    }
+    if (!cursor->header) return false;
+
+    uint32_t i = cursor->position++;
+    cursor->time_ms += cursor->time_delta[i];
+
+    event->time_ms = cursor->time_ms;
+    event->session = cursor->header->session;
+    event->keycode = cursor->keycode[i];
+    event->row = cursor->row[i];
+    event->col = cursor->col[i];
+    event->pressed = (cursor->pressed[i / 8] >> (i % 8)) & 1;
+    return true;
+}
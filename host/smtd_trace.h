@@ -0,0 +1,162 @@
+/* Copyright 2024 Stanislav Markin (https://github.com/stasmarkin)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * Columnar binary trace of sm_td key events, designed to be mmap-ed and replayed as is.
+ *
+ * Layout (little-endian, every part is 8-byte aligned):
+ *
+ *   smtd_trace_header
+ *   block 0: smtd_trace_block, then columns of `events_count` values:
+ *            uint16_t time_delta[]  ms since the previous event of the block, 0 for the first one
+ *            uint16_t keycode[]
+ *            uint8_t  row[]
+ *            uint8_t  col[]
+ *            uint8_t  pressed[]     bitmap, bit i of byte i / 8
+ *   block 1: ...
+ *   smtd_trace_index_entry[blocks_count]   seek index, located at header.index_offset
+ *
+ * A block holds events of one session only. Time and session never decrease through the file,
+ * so the index can be binary searched by both.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SMTD_TRACE_MAGIC "SMTDTRC1"
+#define SMTD_TRACE_VERSION 1
+#define SMTD_TRACE_DEFAULT_BLOCK_CAPACITY 4096
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_capacity;
+    uint64_t events_count;
+    uint64_t index_offset;
+    uint32_t blocks_count;
+    uint32_t reserved;
+} smtd_trace_header;
+
+typedef struct {
+    /** Time of the first event of the block */
+    uint64_t base_time_ms;
+    uint32_t session;
+    uint32_t events_count;
+    /** CRC-32 of the column data */
+    uint32_t checksum;
+    /** Size of the column data right after this header, including the alignment padding */
+    uint32_t data_size;
+} smtd_trace_block;
+
+typedef struct {
+    uint64_t first_time_ms;
+    /** File offset of the smtd_trace_block */
+    uint64_t offset;
+    uint32_t session;
+    uint32_t events_count;
+} smtd_trace_index_entry;
+
+typedef struct {
+    uint64_t time_ms;
+    uint32_t session;
+    uint16_t keycode;
+    uint8_t row;
+    uint8_t col;
+    bool pressed;
+} smtd_trace_event;
+
+/** Human readable description of the last failure of any smtd_trace_* function */
+const char *smtd_trace_error(void);
+
+/* ************************************* *
+ *                WRITER                 *
+ * ************************************* */
+
+typedef struct {
+    int fd;
+    uint32_t block_capacity;
+    uint64_t offset;
+    uint64_t events_count;
+
+    /** Current block, flushed when full or when delta/session doesn't fit into it */
+    smtd_trace_block block;
+    uint64_t last_time_ms;
+    uint16_t *time_delta;
+    uint16_t *keycode;
+    uint8_t *row;
+    uint8_t *col;
+    uint8_t *pressed;
+
+    smtd_trace_index_entry *index;
+    uint32_t index_capacity;
+    uint32_t blocks_count;
+} smtd_trace_writer;
+
+bool smtd_trace_writer_open(smtd_trace_writer *writer, const char *path, uint32_t block_capacity);
+bool smtd_trace_write(smtd_trace_writer *writer, const smtd_trace_event *event);
+bool smtd_trace_writer_close(smtd_trace_writer *writer);
+
+/* ************************************* *
+ *                READER                 *
+ * ************************************* */
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    const smtd_trace_header *header;
+    const smtd_trace_index_entry *index;
+} smtd_trace;
+
+bool smtd_trace_open(smtd_trace *trace, const char *path);
+void smtd_trace_close(smtd_trace *trace);
+
+const smtd_trace_block *smtd_trace_get_block(const smtd_trace *trace, uint32_t block);
+bool smtd_trace_block_valid(const smtd_trace *trace, uint32_t block);
+
+/**
+ * Index of the block to read from to get every event at or after `time_ms`: the block before the first one
+ * starting at or after `time_ms`, since it may end with events at `time_ms` too. Events before `time_ms`
+ * are not skipped. 0 for an empty trace, the last block if all events are before `time_ms`.
+ */
+uint32_t smtd_trace_seek_time(const smtd_trace *trace, uint64_t time_ms);
+
+/** Index of the first block of the first session at or after `session` (blocks_count if there is none) */
+uint32_t smtd_trace_seek_session(const smtd_trace *trace, uint32_t session);
+
+/** Streams events straight from the mapped columns, no allocation and no parsing */
+typedef struct {
+    const smtd_trace *trace;
+    uint32_t block;
+    uint32_t position;
+    uint64_t time_ms;
+
+    const smtd_trace_block *header;
+    const uint16_t *time_delta;
+    const uint16_t *keycode;
+    const uint8_t *row;
+    const uint8_t *col;
+    const uint8_t *pressed;
+
+    /** A block checksum didn't match, so the cursor stopped before it (see smtd_trace_error) */
+    bool corrupted;
+} smtd_trace_cursor;
+
+void smtd_trace_cursor_init(smtd_trace_cursor *cursor, const smtd_trace *trace, uint32_t block);
+
+/** Returns false at the end of the trace or at a corrupted block, `corrupted` tells one from another */
+bool smtd_trace_next(smtd_trace_cursor *cursor, smtd_trace_event *event);
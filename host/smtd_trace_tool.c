@@ -0,0 +1,453 @@
+/* Copyright 2024 Stanislav Markin (https://github.com/stasmarkin)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * smtd-trace: converts recorded key events into sm_td binary traces and inspects them.
+ *
+ *   smtd-trace from-console [-n names] [-s step_ms] [-g gap_ms] [-b block] -o out.smtdt log...
+ *   smtd-trace from-events [-g gap_ms] [-b block] -o out.smtdt events...
+ *   smtd-trace info trace.smtdt
+ *   smtd-trace dump [-t from_ms] [-S session] trace.smtdt
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtd_trace.h"
+
+typedef struct {
+    smtd_trace_writer writer;
+    uint32_t session;
+    uint64_t last_time_ms;
+    uint64_t session_gap_ms;
+    bool started;
+} converter;
+
+static bool convert_event(converter *conv, uint64_t time_ms, uint16_t keycode, uint8_t row, uint8_t col, bool pressed) {
+    // a long pause or a clock going backwards (next log file, reconnected keyboard) starts a new session
+    if (conv->started && (time_ms < conv->last_time_ms || time_ms - conv->last_time_ms > conv->session_gap_ms)) {
+        conv->session++;
+        if (time_ms < conv->last_time_ms) time_ms = conv->last_time_ms;
+    }
+
+    smtd_trace_event event = {
+        .time_ms = time_ms,
+        .session = conv->session,
+        .keycode = keycode,
+        .row = row,
+        .col = col,
+        .pressed = pressed,
+    };
+    if (!smtd_trace_write(&conv->writer, &event)) {
+        fprintf(stderr, "write: %s\n", smtd_trace_error());
+        return false;
+    }
+
+    conv->last_time_ms = time_ms;
+    conv->started = true;
+    return true;
+}
+
+/* ************************************* *
+ *         QMK CONSOLE CONVERTER         *
+ * ************************************* */
+
+typedef struct {
+    char name[32];
+    uint16_t keycode;
+} keycode_name;
+
+static keycode_name *names = NULL;
+static size_t names_count = 0;
+
+static bool load_names(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+
+    char line[128];
+    size_t capacity = 0;
+    while (fgets(line, sizeof(line), file)) {
+        char name[32];
+        long keycode;
+        if (line[0] == '#' || sscanf(line, "%31s %li", name, &keycode) != 2) continue;
+
+        if (names_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            names = realloc(names, capacity * sizeof(*names));
+            if (!names) {
+                perror("realloc");
+                fclose(file);
+                return false;
+            }
+        }
+        snprintf(names[names_count].name, sizeof(names[names_count].name), "%s", name);
+        names[names_count].keycode = (uint16_t) keycode;
+        names_count++;
+    }
+
+    fclose(file);
+    return true;
+}
+
+static bool parse_keycode(const char *token, uint16_t *keycode) {
+    // keycode_to_string() fallback is "KC_<decimal>"
+    char *end;
+    if (strncmp(token, "KC_", 3) == 0 && isdigit((unsigned char) token[3])) {
+        *keycode = (uint16_t) strtoul(token + 3, &end, 10);
+        if (*end == '\0') return true;
+    }
+    for (size_t i = 0; i < names_count; i++) {
+        if (strcmp(names[i].name, token) == 0) {
+            *keycode = names[i].keycode;
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Optional leading timestamp: "[HH:MM:SS.mmm]", "HH:MM:SS.mmm" or seconds with a fraction */
+static bool parse_timestamp(const char *line, uint64_t *time_ms) {
+    while (*line == ' ' || *line == '[') line++;
+
+    unsigned hours, minutes;
+    double seconds;
+    if (sscanf(line, "%u:%u:%lf", &hours, &minutes, &seconds) == 3) {
+        *time_ms = ((uint64_t) hours * 3600 + minutes * 60) * 1000 + (uint64_t) (seconds * 1000.0 + 0.5);
+        return true;
+    }
+    if (isdigit((unsigned char) *line) && sscanf(line, "%lf", &seconds) == 1) {
+        *time_ms = (uint64_t) (seconds * 1000.0 + 0.5);
+        return true;
+    }
+    return false;
+}
+
+static bool convert_console(converter *conv, const char *path, uint64_t step_ms) {
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+
+    // Events replayed by sm_td itself are logged too, they must not get into the trace:
+    // nested ones are logged before the "<<" line of the event being processed,
+    // the ones replayed by timeouts follow FOLLOWING_PRESS, FOLLOWING_RELEASE (one event) and FOLLOWING_TAP
+    // (two events) lines.
+    int depth = 0;
+    int replayed = 0;
+    uint64_t synthetic_ms = conv->last_time_ms;
+
+    char line[512];
+    unsigned long line_no = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_no++;
+
+        if (strstr(line, "<< ")) {
+            if (depth > 0) depth--;
+            continue;
+        }
+        if (depth == 0 && strstr(line, "FOLLOWING_PRESS(")) {
+            replayed += 1;
+            continue;
+        }
+        if (depth == 0 && strstr(line, "FOLLOWING_RELEASE(")) {
+            replayed += 1;
+            continue;
+        }
+        if (depth == 0 && strstr(line, "FOLLOWING_TAP(")) {
+            replayed += 2;
+            continue;
+        }
+
+        const char *got = strstr(line, ">> GOT KEY ");
+        if (!got) continue;
+
+        int nested = depth++;
+        if (nested > 0) continue;
+        if (replayed > 0) {
+            replayed--;
+            continue;
+        }
+
+        char token[64], state[16];
+        if (sscanf(got + strlen(">> GOT KEY "), "%63s %15s", token, state) != 2) {
+            fprintf(stderr, "%s:%lu: malformed key line\n", path, line_no);
+            continue;
+        }
+
+        uint16_t keycode;
+        if (!parse_keycode(token, &keycode)) {
+            fprintf(stderr, "%s:%lu: unknown keycode %s, add it to the names file\n", path, line_no, token);
+            if (file != stdin) fclose(file);
+            return false;
+        }
+
+        uint64_t time_ms;
+        if (!parse_timestamp(line, &time_ms)) {
+            synthetic_ms += step_ms;
+            time_ms = synthetic_ms;
+        }
+
+        // the console log has no matrix positions, so each keycode gets its own synthetic position
+        if (!convert_event(conv, time_ms, keycode, keycode >> 8, keycode & 0xFF, strcmp(state, "PRESSED") == 0)) {
+            if (file != stdin) fclose(file);
+            return false;
+        }
+    }
+
+    if (file != stdin) fclose(file);
+    return true;
+}
+
+/* ************************************* *
+ *         HOST EVENTS CONVERTER         *
+ * ************************************* */
+
+static bool convert_events(converter *conv, const char *path) {
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+
+    char line[256];
+    unsigned long line_no = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        unsigned long long time_ms;
+        unsigned long code;
+        long value;
+        int fields = sscanf(line, "%llu %lu %ld", &time_ms, &code, &value);
+        if (fields <= 0) continue;
+        if (fields != 3 || code > 0xFFFF) {
+            fprintf(stderr, "%s:%lu: expected '<time_ms> <code> <value>'\n", path, line_no);
+            ok = false;
+            break;
+        }
+        if (value != 0 && value != 1) continue;
+
+        // same as smtd-host: the position is the evdev code
+        ok = convert_event(conv, time_ms, (uint16_t) code, (uint8_t) (code >> 8), (uint8_t) code, value == 1);
+    }
+
+    if (file != stdin) fclose(file);
+    return ok;
+}
+
+static int run_convert(int argc, char **argv, bool console) {
+    const char *output = NULL;
+    uint64_t step_ms = 100;
+    uint32_t block_capacity = SMTD_TRACE_DEFAULT_BLOCK_CAPACITY;
+    converter conv = {.session_gap_ms = 60000};
+
+    int option;
+    while ((option = getopt(argc, argv, "o:n:s:g:b:")) != -1) {
+        switch (option) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'n':
+                if (!load_names(optarg)) return 1;
+                break;
+            case 's':
+                step_ms = strtoull(optarg, NULL, 0);
+                break;
+            case 'g':
+                conv.session_gap_ms = strtoull(optarg, NULL, 0);
+                break;
+            case 'b':
+                block_capacity = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            default:
+                return 2;
+        }
+    }
+    if (!output || optind == argc) {
+        fprintf(stderr, "output (-o) and at least one input are required\n");
+        return 2;
+    }
+
+    if (!smtd_trace_writer_open(&conv.writer, output, block_capacity)) {
+        fprintf(stderr, "%s\n", smtd_trace_error());
+        return 1;
+    }
+
+    bool ok = true;
+    for (int i = optind; ok && i < argc; i++) {
+        // every input file is a separate session
+        if (conv.started) {
+            conv.session++;
+            conv.started = false;
+        }
+        ok = console ? convert_console(&conv, argv[i], step_ms) : convert_events(&conv, argv[i]);
+    }
+
+    uint64_t events_count = conv.writer.events_count;
+    if (!smtd_trace_writer_close(&conv.writer)) {
+        fprintf(stderr, "%s: %s\n", output, smtd_trace_error());
+        return 1;
+    }
+    if (ok) fprintf(stderr, "%s: %llu events\n", output, (unsigned long long) events_count);
+    return ok ? 0 : 1;
+}
+
+/* ************************************* *
+ *              INSPECTION               *
+ * ************************************* */
+
+static int run_info(int argc, char **argv) {
+    if (argc != 2) return 2;
+
+    smtd_trace trace;
+    if (!smtd_trace_open(&trace, argv[1])) {
+        fprintf(stderr, "%s: %s\n", argv[1], smtd_trace_error());
+        return 1;
+    }
+
+    const smtd_trace_header *header = trace.header;
+    uint32_t sessions = 0, corrupted = 0;
+    for (uint32_t i = 0; i < header->blocks_count; i++) {
+        if (i == 0 || trace.index[i].session != trace.index[i - 1].session) sessions++;
+        if (!smtd_trace_block_valid(&trace, i)) {
+            fprintf(stderr, "block %u: checksum mismatch\n", i);
+            corrupted++;
+        }
+    }
+
+    printf("events:   %llu\n", (unsigned long long) header->events_count);
+    printf("blocks:   %u (capacity %u events)\n", header->blocks_count, header->block_capacity);
+    printf("sessions: %u\n", sessions);
+    printf("size:     %zu bytes (%.2f bytes/event)\n", trace.size,
+           header->events_count ? (double) trace.size / (double) header->events_count : 0.0);
+    if (header->blocks_count > 0) {
+        // the index has only the first time of each block, so the last block is read for the end time
+        uint64_t last_time_ms = trace.index[header->blocks_count - 1].first_time_ms;
+        smtd_trace_cursor cursor;
+        smtd_trace_event event;
+        smtd_trace_cursor_init(&cursor, &trace, header->blocks_count - 1);
+        while (smtd_trace_next(&cursor, &event)) last_time_ms = event.time_ms;
+
+        printf("time:     %llu .. %llu ms\n", (unsigned long long) trace.index[0].first_time_ms,
+               (unsigned long long) last_time_ms);
+    }
+    printf("checksum: %s\n", corrupted ? "FAILED" : "ok");
+
+    smtd_trace_close(&trace);
+    return corrupted ? 1 : 0;
+}
+
+static int run_dump(int argc, char **argv) {
+    uint64_t from_ms = 0;
+    bool by_session = false;
+    uint32_t session = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "t:S:")) != -1) {
+        switch (option) {
+            case 't':
+                from_ms = strtoull(optarg, NULL, 0);
+                break;
+            case 'S':
+                by_session = true;
+                session = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            default:
+                return 2;
+        }
+    }
+    if (optind != argc - 1) return 2;
+
+    smtd_trace trace;
+    if (!smtd_trace_open(&trace, argv[optind])) {
+        fprintf(stderr, "%s: %s\n", argv[optind], smtd_trace_error());
+        return 1;
+    }
+
+    uint32_t block = by_session ? smtd_trace_seek_session(&trace, session) : smtd_trace_seek_time(&trace, from_ms);
+    smtd_trace_cursor cursor;
+    smtd_trace_cursor_init(&cursor, &trace, block);
+
+    smtd_trace_event event;
+    printf("# session time_ms keycode row col pressed\n");
+    while (smtd_trace_next(&cursor, &event)) {
+        if (event.time_ms < from_ms) continue;
+        if (by_session && event.session != session) break;
+        printf("%u %llu %u %u %u %d\n", event.session, (unsigned long long) event.time_ms, event.keycode, event.row,
+               event.col, event.pressed);
+    }
+
+    if (cursor.corrupted) {
+        fprintf(stderr, "%s: %s\n", argv[optind], smtd_trace_error());
+        smtd_trace_close(&trace);
+        return 1;
+    }
+
+    smtd_trace_close(&trace);
+    return 0;
+}
+
+/* ************************************* *
+ *                 MAIN                  *
+ * ************************************* */
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: smtd-trace from-console [-n names] [-s step_ms] [-g gap_ms] [-b block] -o out.smtdt log...\n"
+            "       smtd-trace from-events [-g gap_ms] [-b block] -o out.smtdt events...\n"
+            "       smtd-trace info trace.smtdt\n"
+            "       smtd-trace dump [-t from_ms] [-S session] trace.smtdt\n"
+            "\n"
+            "from-console reads QMK console output of sm_td built with SMTD_DEBUG_ENABLED\n"
+            "  -n  file of '<name> <keycode>' lines for keycode_to_string_user() names\n"
+            "  -s  time step for lines without a timestamp (default 100 ms)\n"
+            "from-events reads '<time_ms> <evdev code> <value>' lines (smtd-host -f format)\n"
+            "  -g  pause that starts a new session (default 60000 ms)\n"
+            "  -b  events per block (default %d)\n",
+            SMTD_TRACE_DEFAULT_BLOCK_CAPACITY);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage();
+        return 2;
+    }
+
+    const char *command = argv[1];
+    int result = 2;
+    if (strcmp(command, "from-console") == 0) {
+        result = run_convert(argc - 1, argv + 1, true);
+    } else if (strcmp(command, "from-events") == 0) {
+        result = run_convert(argc - 1, argv + 1, false);
+    } else if (strcmp(command, "info") == 0) {
+        result = run_info(argc - 1, argv + 1);
+    } else if (strcmp(command, "dump") == 0) {
+        result = run_dump(argc - 1, argv + 1);
+    }
+
+    if (result == 2) usage();
+    return result;
+}
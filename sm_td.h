@@ -26,9 +26,8 @@
 #include "print.h"
 #endif
 
-#ifdef SMTD_GLOBAL_SIMULTANEOUS_PRESSES_DELAY_MS
 #include "timer.h"
-#endif
+#include "progmem.h"
 
 /* ************************************* *
  *         GLOBAL CONFIGURATION          *
@@ -68,6 +67,56 @@
 #define SMTD_GLOBAL_AGGREGATE_TAPS false
 #endif
 
+#ifndef SMTD_GLOBAL_CLASSIFIER
+#define SMTD_GLOBAL_CLASSIFIER false
+#endif
+
+/* ************************************* *
+ *       CLASSIFIER CONFIGURATION        *
+ * ************************************* */
+
+// Weights of the tap-vs-hold linear model. They are integers in arbitrary fixed-point units
+// (e.g. 256 = 1.0) and are meant to be trained offline on labelled traces.
+// With all weights set to zero the classifier never commits earlier than the regular timeouts.
+
+#ifndef SMTD_CLASSIFIER_BIAS
+#define SMTD_CLASSIFIER_BIAS 0
+#endif
+
+#ifndef SMTD_CLASSIFIER_W_TOUCH_MS
+#define SMTD_CLASSIFIER_W_TOUCH_MS 0
+#endif
+
+#ifndef SMTD_CLASSIFIER_W_OVERLAP_MS
+#define SMTD_CLASSIFIER_W_OVERLAP_MS 0
+#endif
+
+#ifndef SMTD_CLASSIFIER_W_RELEASE_GAP_MS
+#define SMTD_CLASSIFIER_W_RELEASE_GAP_MS 0
+#endif
+
+#ifndef SMTD_CLASSIFIER_W_SEQUENCE_LEN
+#define SMTD_CLASSIFIER_W_SEQUENCE_LEN 0
+#endif
+
+#ifndef SMTD_CLASSIFIER_W_SAME_HAND
+#define SMTD_CLASSIFIER_W_SAME_HAND 0
+#endif
+
+// score >= SMTD_CLASSIFIER_HOLD_SCORE commits HOLD, score <= SMTD_CLASSIFIER_TAP_SCORE commits TAP
+#ifndef SMTD_CLASSIFIER_HOLD_SCORE
+#define SMTD_CLASSIFIER_HOLD_SCORE INT16_MAX
+#endif
+
+#ifndef SMTD_CLASSIFIER_TAP_SCORE
+#define SMTD_CLASSIFIER_TAP_SCORE INT16_MIN
+#endif
+
+// time features are clamped, so the score can't overflow with 16-bit weights
+#ifndef SMTD_CLASSIFIER_MAX_MS
+#define SMTD_CLASSIFIER_MAX_MS 1023
+#endif
+
 /* ************************************* *
  *          DEBUG CONFIGURATION          *
  * ************************************* */
@@ -130,6 +179,7 @@ uint32_t get_smtd_timeout_or_default(uint16_t keycode, smtd_timeout timeout) {
 typedef enum {
     SMTD_FEATURE_MODS_RECALL,
     SMTD_FEATURE_AGGREGATE_TAPS,
+    SMTD_FEATURE_CLASSIFIER,
 } smtd_feature;
 
 __attribute__((weak)) bool smtd_feature_enabled(uint16_t keycode, smtd_feature feature);
@@ -140,6 +190,8 @@ bool smtd_feature_enabled_default(smtd_feature feature) {
             return SMTD_GLOBAL_MODS_RECALL;
         case SMTD_FEATURE_AGGREGATE_TAPS:
             return SMTD_GLOBAL_AGGREGATE_TAPS;
+        case SMTD_FEATURE_CLASSIFIER:
+            return SMTD_GLOBAL_CLASSIFIER;
     }
     return false;
 }
@@ -188,6 +240,24 @@ void on_smtd_action(uint16_t keycode, smtd_action action, uint8_t sequence_len);
 #define SMTD_ACTION(action, state) on_smtd_action(state->macro_keycode, action, state->sequence_len);
 #endif
 
+/**
+ * Called from a TOUCH action that has already applied the hold (like SMTD_LTE does), so the key pressed
+ * after the macro key is emitted right away instead of waiting for the tap/hold decision.
+ * The emitted key is not buffered: if the macro key turns out to be a tap, the host has already got
+ * that key press on the hold layer. It is released, the TAP action rolls the touch back
+ * and the key is pressed again.
+ * A following sm_td macro key is not emitted early, since its own state can't be rolled back.
+ */
+#define SMTD_SPECULATE() smtd_touch_speculative = true;
+
+/**
+ * With aggregated taps the TAP action comes only after the sequence, so a touch applying the hold
+ * would stay on between the taps. Such keys should not speculate.
+ */
+#define SMTD_CAN_SPECULATE(keycode) (!smtd_feature_enabled_or_default(keycode, SMTD_FEATURE_AGGREGATE_TAPS))
+
+static bool smtd_touch_speculative = false;
+
 /* ************************************* *
  *       USER STATES DEFINITIONS         *
  * ************************************* */
@@ -225,6 +295,9 @@ typedef struct {
     /** The keycode of the macro key */
     uint16_t macro_keycode;
 
+    /** The position of the macro key */
+    keypos_t macro_key;
+
     /** The mods before the touch action performed. Required for mod_recall feature */
     uint8_t modes_before_touch;
 
@@ -240,6 +313,12 @@ typedef struct {
     /** The keycode of the key that was pressed after macro was pressed */
     uint16_t following_keycode;
 
+    /** The time when the macro key was touched. Required for classifier feature */
+    uint16_t touch_time;
+
+    /** The time when the following key was pressed. Required for classifier feature */
+    uint16_t following_time;
+
     /** The timeout of current stage */
     deferred_token timeout;
 
@@ -248,52 +327,249 @@ typedef struct {
 
     /** The flag that indicates that the state is frozen, so it won't handle any events */
     bool freeze;
+
+    /** The touch action has called SMTD_SPECULATE() */
+    bool speculative;
+
+    /** The following key is already pressed on the speculative layer and mods, it is released on a tap */
+    bool following_speculated;
 } smtd_state;
 
 #define EMPTY_STATE {                       \
         .macro_keycode = 0,                 \
+        .macro_key = MAKE_KEYPOS(0, 0),     \
         .modes_before_touch = 0,            \
         .modes_with_touch = 0,              \
         .sequence_len = 0,                  \
         .following_key = MAKE_KEYPOS(0, 0), \
         .following_keycode = 0,             \
+        .touch_time = 0,                    \
+        .following_time = 0,                \
         .timeout = INVALID_DEFERRED_TOKEN,  \
         .stage = SMTD_STAGE_NONE,           \
-        .freeze = false                     \
+        .freeze = false,                    \
+        .speculative = false,               \
+        .following_speculated = false       \
 }
 
 /* ************************************* *
  *             LAYER UTILS               *
  * ************************************* */
 
-#define RETURN_LAYER_NOT_SET 15
+typedef struct {
+    /** The macro keycode that has turned the layer on, or SMTD_LAYER_ANONYMOUS */
+    uint16_t owner;
+    uint8_t layer;
+} smtd_layer_entry;
 
-static uint8_t return_layer = RETURN_LAYER_NOT_SET;
-static uint8_t return_layer_cnt = 0;
+// one entry per held macro key, so it can't be deeper than smtd_active_states
+#define SMTD_LAYER_STACK_SIZE 10
 
-void avoid_unused_variable_on_compile(void* ptr) {
-    // just touch them, so compiler won't throw "defined but not used" error
-    // that variables are used in macros that user may not use
-    if (return_layer == RETURN_LAYER_NOT_SET) return_layer = RETURN_LAYER_NOT_SET;
-    if (return_layer_cnt == 0) return_layer_cnt = 0;
-}
+static smtd_layer_entry smtd_layer_stack[SMTD_LAYER_STACK_SIZE];
+static uint8_t smtd_layer_stack_size = 0;
 
-#define LAYER_PUSH(layer)                              \
-    return_layer_cnt++;                                \
-    if (return_layer == RETURN_LAYER_NOT_SET) {        \
-        return_layer = get_highest_layer(layer_state); \
-    }                                                  \
+/** The layer before the first push, it is restored when the stack gets empty */
+static uint8_t smtd_layer_base = 0;
+
+/** Owner of LAYER_PUSH()/LAYER_RESTORE() entries, they may be pushed many times and are restored last in first out */
+#define SMTD_LAYER_ANONYMOUS 0
+
+void smtd_layer_apply(uint8_t layer) {
+    // layer_move() rebuilds layer_state and runs layer callbacks, so it is called only on a real change.
+    // Layer 0 is also active with an empty layer_state
+    layer_state_t target = (layer_state_t) 1 << layer;
+    if (layer_state == target || (layer == 0 && layer_state == 0)) {
+        return;
+    }
     layer_move(layer);
+}
+
+bool smtd_layer_stack_remove(uint16_t owner) {
+    for (uint8_t i = smtd_layer_stack_size; i-- > 0;) {
+        if (smtd_layer_stack[i].owner != owner) continue;
 
-#define LAYER_RESTORE()                          \
-    if (return_layer_cnt > 0) {                  \
-        return_layer_cnt--;                      \
-        if (return_layer_cnt == 0) {             \
-            layer_move(return_layer);            \
-            return_layer = RETURN_LAYER_NOT_SET; \
-        }                                        \
+        for (uint8_t j = i; j < smtd_layer_stack_size - 1; j++) {
+            smtd_layer_stack[j] = smtd_layer_stack[j + 1];
+        }
+        smtd_layer_stack_size--;
+        return true;
+    }
+    return false;
+}
+
+void smtd_layer_push(uint16_t owner, uint8_t layer) {
+    if (smtd_layer_stack_size == 0) {
+        smtd_layer_base = get_highest_layer(layer_state);
+    }
+
+    // the same key pushing again just moves its layer on top
+    if (owner != SMTD_LAYER_ANONYMOUS) {
+        smtd_layer_stack_remove(owner);
+    }
+    if (smtd_layer_stack_size == SMTD_LAYER_STACK_SIZE) {
+        return;
+    }
+    smtd_layer_stack[smtd_layer_stack_size].owner = owner;
+    smtd_layer_stack[smtd_layer_stack_size].layer = layer;
+    smtd_layer_stack_size++;
+
+    smtd_layer_apply(layer);
+}
+
+void smtd_layer_restore(uint16_t owner) {
+    // holds may be released in any order, the layer of the latest key still held wins
+    if (!smtd_layer_stack_remove(owner)) {
+        return;
+    }
+    smtd_layer_apply(smtd_layer_stack_size > 0 ? smtd_layer_stack[smtd_layer_stack_size - 1].layer
+                                               : smtd_layer_base);
+}
+
+/**
+ * Turns the layer on for `owner` (usually the macro keycode) until SMTD_LAYER_RESTORE() with the same owner.
+ * Holds may be released in any order, the layer of the latest owner still holding it is active.
+ */
+#define SMTD_LAYER_PUSH(owner, layer) smtd_layer_push(owner, layer);
+
+#define SMTD_LAYER_RESTORE(owner) smtd_layer_restore(owner);
+
+// Without an owner, kept for existing keymaps: every LAYER_RESTORE() drops the latest LAYER_PUSH()
+#define LAYER_PUSH(layer) smtd_layer_push(SMTD_LAYER_ANONYMOUS, layer);
+
+#define LAYER_RESTORE() smtd_layer_restore(SMTD_LAYER_ANONYMOUS);
+
+/* ************************************* *
+ *        PER KEY PAIR TIMEOUTS          *
+ * ************************************* */
+
+#ifdef SMTD_PAIR_TERMS_ENABLED
+
+typedef struct {
+    /** Macro key and following key positions packed as macro row, macro col, following row, following col */
+    uint32_t pair;
+
+    /** SMTD_TIMEOUT_RELEASE for this pair, 0 means fallback to the per key timeout */
+    uint16_t release;
+
+    /** SMTD_TIMEOUT_FOLLOWING_TAP for this pair, 0 means fallback to the per key timeout */
+    uint16_t following_tap;
+} smtd_pair_term;
+
+// generated by tools/smtd_pair_terms.py and placed next to your keymap.c
+#include "smtd_pair_terms.h"
+
+uint32_t smtd_pair_hash(uint32_t pair, uint32_t seed) {
+    // must match pair_hash() in tools/smtd_pair_terms.py
+    uint32_t x = pair ^ seed;
+    x ^= x >> 16;
+    x *= 0x7FEB352DUL;
+    x ^= x >> 15;
+    x *= 0x846CA68BUL;
+    x ^= x >> 16;
+    return x;
+}
+
+uint32_t get_smtd_pair_timeout(smtd_state *state, smtd_timeout timeout) {
+    uint32_t pair = ((uint32_t) state->macro_key.row << 24) | ((uint32_t) state->macro_key.col << 16)
+                    | ((uint32_t) state->following_key.row << 8) | state->following_key.col;
+
+    uint8_t displacement = pgm_read_byte(
+            &smtd_pair_terms_displacement[smtd_pair_hash(pair, SMTD_PAIR_TERMS_SEED) % SMTD_PAIR_TERMS_BUCKETS]);
+    const smtd_pair_term *term =
+            &smtd_pair_terms[smtd_pair_hash(pair, SMTD_PAIR_TERMS_SEED + 1 + displacement) % SMTD_PAIR_TERMS_SIZE];
+
+    // the table is minimal, so any unknown pair lands on some other pair's slot
+    if (pgm_read_dword(&term->pair) != pair) {
+        return 0;
     }
 
+    switch (timeout) {
+        case SMTD_TIMEOUT_RELEASE:
+            return pgm_read_word(&term->release);
+        case SMTD_TIMEOUT_FOLLOWING_TAP:
+            return pgm_read_word(&term->following_tap);
+        default:
+            return 0;
+    }
+}
+
+#endif
+
+/* ************************************* *
+ *   TAP/HOLD CLASSIFIER IMPLEMENTATION  *
+ * ************************************* */
+
+__attribute__((weak)) bool smtd_is_same_hand(keypos_t macro_key, keypos_t following_key);
+
+int32_t smtd_classifier_ms(uint16_t elapsed) {
+    return elapsed < SMTD_CLASSIFIER_MAX_MS ? elapsed : SMTD_CLASSIFIER_MAX_MS;
+}
+
+/**
+ * The score grows linearly with the time spent in the current stage (by `slope` per ms),
+ * so we can tell upfront after how many ms it reaches `threshold` and schedule the decision
+ * at that moment instead of the regular stage timeout.
+ */
+uint32_t smtd_classifier_crossing(int32_t score, int32_t slope, int32_t threshold, uint32_t timeout) {
+    if (score >= threshold) {
+        return 1; // defer_exec won't schedule zero delay
+    }
+    if (slope <= 0) {
+        return timeout;
+    }
+    uint32_t crossing = (uint32_t) ((threshold - score + slope - 1) / slope);
+    return crossing < timeout ? crossing : timeout;
+}
+
+uint32_t smtd_classifier_timeout(smtd_state *state, smtd_timeout timeout, uint32_t term) {
+    int32_t score = SMTD_CLASSIFIER_BIAS + SMTD_CLASSIFIER_W_SEQUENCE_LEN * (int32_t) state->sequence_len;
+
+    switch (timeout) {
+        case SMTD_TIMEOUT_TAP:
+            // touch time is growing, the macro key is held alone
+            return smtd_classifier_crossing(score, SMTD_CLASSIFIER_W_TOUCH_MS,
+                                            SMTD_CLASSIFIER_HOLD_SCORE, term);
+
+        case SMTD_TIMEOUT_FOLLOWING_TAP:
+            // touch time is known, overlap with the following key is growing
+            score += SMTD_CLASSIFIER_W_TOUCH_MS * smtd_classifier_ms(state->following_time - state->touch_time);
+            if (smtd_is_same_hand && smtd_is_same_hand(state->macro_key, state->following_key)) {
+                score += SMTD_CLASSIFIER_W_SAME_HAND;
+            }
+            return smtd_classifier_crossing(score, SMTD_CLASSIFIER_W_OVERLAP_MS,
+                                            SMTD_CLASSIFIER_HOLD_SCORE, term);
+
+        case SMTD_TIMEOUT_RELEASE:
+            // touch time and overlap are known, the gap after macro key release is growing
+            score += SMTD_CLASSIFIER_W_TOUCH_MS * smtd_classifier_ms(state->following_time - state->touch_time);
+            score += SMTD_CLASSIFIER_W_OVERLAP_MS * smtd_classifier_ms(timer_elapsed(state->following_time));
+            if (smtd_is_same_hand && smtd_is_same_hand(state->macro_key, state->following_key)) {
+                score += SMTD_CLASSIFIER_W_SAME_HAND;
+            }
+            // looking for a tap here, so the score should go down below the tap threshold
+            return smtd_classifier_crossing(-score, -SMTD_CLASSIFIER_W_RELEASE_GAP_MS,
+                                            -SMTD_CLASSIFIER_TAP_SCORE, term);
+
+        case SMTD_TIMEOUT_SEQUENCE:
+            return term;
+    }
+    return term;
+}
+
+uint32_t get_smtd_stage_timeout(smtd_state *state, smtd_timeout timeout) {
+    uint32_t term = 0;
+    #ifdef SMTD_PAIR_TERMS_ENABLED
+    term = get_smtd_pair_timeout(state, timeout);
+    #endif
+    if (!term) {
+        term = get_smtd_timeout_or_default(state->macro_keycode, timeout);
+    }
+    if (!smtd_feature_enabled_or_default(state->macro_keycode, SMTD_FEATURE_CLASSIFIER)) {
+        return term;
+    }
+    return smtd_classifier_timeout(state, timeout, term);
+}
+
 /* ************************************* *
  *      CORE LOGIC IMPLEMENTATION        *
  * ************************************* */
@@ -350,50 +626,318 @@ void smtd_press_following_key(smtd_state *state, bool release) {
     state->freeze = false;
 }
 
+void smtd_release_following_key(smtd_state *state) {
+    state->freeze = true;
+    keyevent_t event_release = MAKE_KEYEVENT(state->following_key.row, state->following_key.col, false);
+    keyrecord_t record_release = {.event = event_release};
+    #ifdef SMTD_DEBUG_ENABLED
+    printf("FOLLOWING_RELEASE(%s) by %s in %s\n", keycode_to_string(state->following_keycode),
+           keycode_to_string(state->macro_keycode), smtd_stage_to_string(state->stage));
+    #endif
+    process_record(&record_release);
+    state->freeze = false;
+}
+
 void smtd_next_stage(smtd_state *state, smtd_stage next_stage);
 
+/* ************************************* *
+ *       STAGE TRANSITIONS TABLE         *
+ * ************************************* */
+
+typedef enum {
+    SMTD_EVENT_MACRO_PRESS,
+    SMTD_EVENT_MACRO_RELEASE,
+    SMTD_EVENT_FOLLOWING_PRESS,
+    SMTD_EVENT_FOLLOWING_RELEASE,
+    SMTD_EVENT_OTHER_PRESS,
+    SMTD_EVENT_OTHER_RELEASE,
+    SMTD_EVENT_TIMEOUT,
+
+    SMTD_EVENTS_COUNT,
+} smtd_event;
+
+// smtd_stage has no sentinel since it is switched over without default, SMTD_STAGE_RELEASE must stay the last one
+#define SMTD_STAGES_COUNT (SMTD_STAGE_RELEASE + 1)
+
+typedef enum {
+    /** Stop and let the event go further. Zero, so missing transitions pass the event */
+    SMTD_OP_PASS = 0,
+    /** Stop and consume the event */
+    SMTD_OP_HANDLED,
+
+    /** Move to the stage, must keep the same order as smtd_stage */
+    SMTD_OP_STAGE_NONE,
+    SMTD_OP_STAGE_TOUCH,
+    SMTD_OP_STAGE_SEQUENCE,
+    SMTD_OP_STAGE_FOLLOWING_TOUCH,
+    SMTD_OP_STAGE_HOLD,
+    SMTD_OP_STAGE_RELEASE,
+
+    /** Tap the macro key (with mods recall) */
+    SMTD_OP_TAP,
+    /** Tap the macro key only if SMTD_FEATURE_AGGREGATE_TAPS is enabled */
+    SMTD_OP_TAP_IF_AGGREGATE,
+    /** Tap the macro key only if SMTD_FEATURE_AGGREGATE_TAPS is disabled */
+    SMTD_OP_TAP_IF_NOT_AGGREGATE,
+    SMTD_OP_ACTION_HOLD,
+    SMTD_OP_ACTION_RELEASE,
+
+    SMTD_OP_SEQUENCE_INC,
+    SMTD_OP_SEQUENCE_RESET,
+    SMTD_OP_DELAY,
+
+    /** Remember the current event key as the following key */
+    SMTD_OP_SAVE_FOLLOWING,
+    /** Press the following key right away if the touch is speculative */
+    SMTD_OP_SPECULATE_FOLLOWING,
+    /** Press (without releasing) the following key */
+    SMTD_OP_PRESS_FOLLOWING,
+    /** Press and release the following key */
+    SMTD_OP_TAP_FOLLOWING,
+    /** Rerun the current event key press with the state frozen, since the layer might have changed */
+    SMTD_OP_REPLAY_FROZEN,
+    /** Rerun the current event key press, the state must be already released */
+    SMTD_OP_REPLAY,
+
+    SMTD_OPS_COUNT,
+} smtd_op;
+
+_Static_assert(SMTD_OP_STAGE_RELEASE - SMTD_OP_STAGE_NONE == SMTD_STAGE_RELEASE - SMTD_STAGE_NONE,
+               "SMTD_OP_STAGE_* must keep the same order as smtd_stage");
+
+#define SMTD_TRANSITION_OPS 8
+
+/**
+ * What a state does on each event class in each stage. Each transition is a short list of micro ops,
+ * that ends with SMTD_OP_PASS or SMTD_OP_HANDLED. Transitions not listed here just pass the event.
+ */
+static const uint8_t smtd_transitions[SMTD_STAGES_COUNT][SMTD_EVENTS_COUNT][SMTD_TRANSITION_OPS] PROGMEM = {
+    [SMTD_STAGE_NONE] = {
+        [SMTD_EVENT_MACRO_PRESS] = {SMTD_OP_STAGE_TOUCH, SMTD_OP_HANDLED},
+    },
+
+    [SMTD_STAGE_TOUCH] = {
+        [SMTD_EVENT_MACRO_RELEASE] = {SMTD_OP_STAGE_SEQUENCE, SMTD_OP_TAP_IF_NOT_AGGREGATE, SMTD_OP_HANDLED},
+        [SMTD_EVENT_FOLLOWING_PRESS] = {SMTD_OP_SAVE_FOLLOWING, SMTD_OP_STAGE_FOLLOWING_TOUCH,
+                                        SMTD_OP_SPECULATE_FOLLOWING, SMTD_OP_HANDLED},
+        [SMTD_EVENT_OTHER_PRESS] = {SMTD_OP_SAVE_FOLLOWING, SMTD_OP_STAGE_FOLLOWING_TOUCH,
+                                    SMTD_OP_SPECULATE_FOLLOWING, SMTD_OP_HANDLED},
+        [SMTD_EVENT_TIMEOUT] = {SMTD_OP_STAGE_HOLD, SMTD_OP_HANDLED},
+    },
+
+    [SMTD_STAGE_SEQUENCE] = {
+        [SMTD_EVENT_MACRO_PRESS] = {SMTD_OP_SEQUENCE_INC, SMTD_OP_STAGE_TOUCH, SMTD_OP_HANDLED},
+        [SMTD_EVENT_FOLLOWING_PRESS] = {SMTD_OP_TAP_IF_AGGREGATE, SMTD_OP_STAGE_NONE, SMTD_OP_PASS},
+        [SMTD_EVENT_OTHER_PRESS] = {SMTD_OP_TAP_IF_AGGREGATE, SMTD_OP_STAGE_NONE, SMTD_OP_PASS},
+        [SMTD_EVENT_TIMEOUT] = {SMTD_OP_TAP_IF_AGGREGATE, SMTD_OP_STAGE_NONE, SMTD_OP_HANDLED},
+    },
+
+    // macro key and following key are pressed, none of them is assumed to be held yet
+    [SMTD_STAGE_FOLLOWING_TOUCH] = {
+        [SMTD_EVENT_MACRO_RELEASE] = {SMTD_OP_STAGE_RELEASE, SMTD_OP_HANDLED},
+        // following key is released, so macro key is definitely held
+        [SMTD_EVENT_FOLLOWING_RELEASE] = {SMTD_OP_STAGE_HOLD, SMTD_OP_DELAY, SMTD_OP_TAP_FOLLOWING, SMTD_OP_HANDLED},
+        // 3rd key is pressed, so hold macro key, hold following key and press the 3rd key on a possibly new layer
+        [SMTD_EVENT_OTHER_PRESS] = {SMTD_OP_STAGE_HOLD, SMTD_OP_DELAY, SMTD_OP_PRESS_FOLLOWING,
+                                    SMTD_OP_DELAY, SMTD_OP_REPLAY_FROZEN, SMTD_OP_HANDLED},
+        [SMTD_EVENT_TIMEOUT] = {SMTD_OP_STAGE_HOLD, SMTD_OP_DELAY, SMTD_OP_PRESS_FOLLOWING, SMTD_OP_HANDLED},
+    },
+
+    [SMTD_STAGE_HOLD] = {
+        [SMTD_EVENT_MACRO_RELEASE] = {SMTD_OP_ACTION_RELEASE, SMTD_OP_STAGE_NONE, SMTD_OP_HANDLED},
+    },
+
+    // macro key is released and following key is still held
+    [SMTD_STAGE_RELEASE] = {
+        //todo need to go to NONE stage and from NONE jump to TOUCH stage
+        [SMTD_EVENT_MACRO_PRESS] = {SMTD_OP_TAP, SMTD_OP_DELAY, SMTD_OP_PRESS_FOLLOWING,
+                                    SMTD_OP_DELAY, SMTD_OP_STAGE_TOUCH, SMTD_OP_SEQUENCE_RESET, SMTD_OP_HANDLED},
+        // following key is released, so macro key was held and following key is tapped
+        [SMTD_EVENT_FOLLOWING_RELEASE] = {SMTD_OP_ACTION_HOLD, SMTD_OP_DELAY, SMTD_OP_TAP_FOLLOWING,
+                                          SMTD_OP_DELAY, SMTD_OP_ACTION_RELEASE, SMTD_OP_STAGE_NONE, SMTD_OP_HANDLED},
+        // 3rd key is pressed, so tap macro key, press following key and press the 3rd key on a possibly new layer
+        [SMTD_EVENT_OTHER_PRESS] = {SMTD_OP_TAP, SMTD_OP_DELAY, SMTD_OP_PRESS_FOLLOWING,
+                                    SMTD_OP_STAGE_NONE, SMTD_OP_DELAY, SMTD_OP_REPLAY, SMTD_OP_HANDLED},
+        [SMTD_EVENT_TIMEOUT] = {SMTD_OP_TAP, SMTD_OP_DELAY, SMTD_OP_PRESS_FOLLOWING, SMTD_OP_STAGE_NONE,
+                                SMTD_OP_HANDLED},
+    },
+};
+
+smtd_event smtd_classify_event(uint16_t keycode, keyrecord_t *record, smtd_state *state) {
+    if (keycode == state->macro_keycode) {
+        return record->event.pressed ? SMTD_EVENT_MACRO_PRESS : SMTD_EVENT_MACRO_RELEASE;
+    }
+    if (state->following_key.row == record->event.key.row && state->following_key.col == record->event.key.col) {
+        return record->event.pressed ? SMTD_EVENT_FOLLOWING_PRESS : SMTD_EVENT_FOLLOWING_RELEASE;
+    }
+    return record->event.pressed ? SMTD_EVENT_OTHER_PRESS : SMTD_EVENT_OTHER_RELEASE;
+}
+
+/**
+ * Runs the transition of `stage` on `event` for the state.
+ * `keycode` and `record` are 0 and NULL for SMTD_EVENT_TIMEOUT, since timeout transitions don't touch the event.
+ * Returns false if the event is handled, like process_smtd_state.
+ */
+bool smtd_apply_transition(smtd_state *state, smtd_stage stage, smtd_event event,
+                           uint16_t keycode, keyrecord_t *record) {
+    const uint8_t *ops = smtd_transitions[stage][event];
+
+    for (uint8_t i = 0; i < SMTD_TRANSITION_OPS; i++) {
+        uint8_t op = pgm_read_byte(&ops[i]);
+        switch (op) {
+            case SMTD_OP_PASS:
+                return true;
+
+            case SMTD_OP_HANDLED:
+                return false;
+
+            case SMTD_OP_STAGE_NONE:
+            case SMTD_OP_STAGE_TOUCH:
+            case SMTD_OP_STAGE_SEQUENCE:
+            case SMTD_OP_STAGE_FOLLOWING_TOUCH:
+            case SMTD_OP_STAGE_HOLD:
+            case SMTD_OP_STAGE_RELEASE:
+                smtd_next_stage(state, (smtd_stage) (op - SMTD_OP_STAGE_NONE));
+                break;
+
+            case SMTD_OP_TAP_IF_AGGREGATE:
+                if (smtd_feature_enabled_or_default(state->macro_keycode, SMTD_FEATURE_AGGREGATE_TAPS)) {
+                    DO_ACTION_TAP(state)
+                }
+                break;
+
+            case SMTD_OP_TAP_IF_NOT_AGGREGATE:
+                if (!smtd_feature_enabled_or_default(state->macro_keycode, SMTD_FEATURE_AGGREGATE_TAPS)) {
+                    DO_ACTION_TAP(state)
+                }
+                break;
+
+            case SMTD_OP_TAP: {
+                // the speculatively pressed following key is released before the touch is rolled back,
+                // so PRESS_FOLLOWING presses it again on the base layer
+                if (state->following_speculated) {
+                    smtd_release_following_key(state);
+                    state->following_speculated = false;
+                    SMTD_SIMULTANEOUS_PRESSES_DELAY
+                }
+                DO_ACTION_TAP(state)
+                break;
+            }
+
+            case SMTD_OP_ACTION_HOLD:
+                SMTD_ACTION(SMTD_ACTION_HOLD, state)
+                break;
+
+            case SMTD_OP_ACTION_RELEASE:
+                SMTD_ACTION(SMTD_ACTION_RELEASE, state)
+                break;
+
+            case SMTD_OP_SEQUENCE_INC:
+                state->sequence_len++;
+                break;
+
+            case SMTD_OP_SEQUENCE_RESET:
+                state->sequence_len = 0;
+                break;
+
+            case SMTD_OP_DELAY:
+                SMTD_SIMULTANEOUS_PRESSES_DELAY
+                break;
+
+            case SMTD_OP_SAVE_FOLLOWING:
+                state->following_key = record->event.key;
+                state->following_keycode = keycode;
+                break;
+
+            case SMTD_OP_SPECULATE_FOLLOWING:
+                // a macro key press would start a state of its own, and the rollback release would tap it
+                if (state->speculative && (state->following_keycode <= SMTD_KEYCODES_BEGIN
+                                           || SMTD_KEYCODES_END <= state->following_keycode)) {
+                    smtd_press_following_key(state, false);
+                    state->following_speculated = true;
+                }
+                break;
+
+            case SMTD_OP_PRESS_FOLLOWING:
+                // it is a hold, so the speculative press was right
+                if (state->following_speculated) {
+                    state->following_speculated = false;
+                    break;
+                }
+                smtd_press_following_key(state, false);
+                break;
+
+            case SMTD_OP_TAP_FOLLOWING:
+                if (state->following_speculated) {
+                    state->following_speculated = false;
+                    smtd_release_following_key(state);
+                    break;
+                }
+                smtd_press_following_key(state, true);
+                break;
+
+            case SMTD_OP_REPLAY_FROZEN:
+            case SMTD_OP_REPLAY: {
+                // by holding previous keys we might have changed a layer, so the current keycode might be not actual,
+                // so we simulate the press again instead of continue processing the wrong key
+                keyevent_t event_press = MAKE_KEYEVENT(record->event.key.row, record->event.key.col, true);
+                keyrecord_t record_press = {.event = event_press};
+                if (op == SMTD_OP_REPLAY_FROZEN) state->freeze = true;
+                process_record(&record_press);
+                if (op == SMTD_OP_REPLAY_FROZEN) state->freeze = false;
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * States are shifted in smtd_active_states when an earlier state is released, so a pointer given to defer_exec
+ * may point to another state by the time the callback fires. Callbacks get the macro keycode instead,
+ * which is unique among active states.
+ */
+#define SMTD_CB_ARG(state) ((void *) (uintptr_t) (state)->macro_keycode)
+
+smtd_state *smtd_state_by_cb_arg(void *cb_arg) {
+    uint16_t keycode = (uint16_t) (uintptr_t) cb_arg;
+    for (uint8_t i = 0; i < smtd_active_states_size; i++) {
+        if (smtd_active_states[i].macro_keycode == keycode) {
+            return &smtd_active_states[i];
+        }
+    }
+    return NULL;
+}
+
 uint32_t timeout_reset_seq(uint32_t trigger_time, void *cb_arg) {
-    smtd_state *state = (smtd_state *) cb_arg;
-    state->sequence_len = 0;
+    smtd_state *state = smtd_state_by_cb_arg(cb_arg);
+    if (state) state->sequence_len = 0;
 
     return 0;
 }
 
 uint32_t timeout_touch(uint32_t trigger_time, void *cb_arg) {
-    smtd_state *state = (smtd_state *) cb_arg;
-    smtd_next_stage(state, SMTD_STAGE_HOLD);
+    smtd_state *state = smtd_state_by_cb_arg(cb_arg);
+    if (state) smtd_apply_transition(state, SMTD_STAGE_TOUCH, SMTD_EVENT_TIMEOUT, 0, NULL);
     return 0;
 }
 
 uint32_t timeout_sequence(uint32_t trigger_time, void *cb_arg) {
-    smtd_state *state = (smtd_state *) cb_arg;
-
-    if (smtd_feature_enabled_or_default(state->macro_keycode, SMTD_FEATURE_AGGREGATE_TAPS)) {
-        DO_ACTION_TAP(state);
-    }
-
-    smtd_next_stage(state, SMTD_STAGE_NONE);
+    smtd_state *state = smtd_state_by_cb_arg(cb_arg);
+    if (state) smtd_apply_transition(state, SMTD_STAGE_SEQUENCE, SMTD_EVENT_TIMEOUT, 0, NULL);
     return 0;
 }
 
 uint32_t timeout_following_touch(uint32_t trigger_time, void *cb_arg) {
-    smtd_state *state = (smtd_state *) cb_arg;
-    smtd_next_stage(state, SMTD_STAGE_HOLD);
-
-    SMTD_SIMULTANEOUS_PRESSES_DELAY
-    smtd_press_following_key(state, false);
+    smtd_state *state = smtd_state_by_cb_arg(cb_arg);
+    if (state) smtd_apply_transition(state, SMTD_STAGE_FOLLOWING_TOUCH, SMTD_EVENT_TIMEOUT, 0, NULL);
     return 0;
 }
 
 uint32_t timeout_release(uint32_t trigger_time, void *cb_arg) {
-    smtd_state *state = (smtd_state *) cb_arg;
-
-    DO_ACTION_TAP(state);
-
-    SMTD_SIMULTANEOUS_PRESSES_DELAY
-    smtd_press_following_key(state, false);
-
-    smtd_next_stage(state, SMTD_STAGE_NONE);
+    smtd_state *state = smtd_state_by_cb_arg(cb_arg);
+    if (state) smtd_apply_transition(state, SMTD_STAGE_RELEASE, SMTD_EVENT_TIMEOUT, 0, NULL);
     return 0;
 }
 
@@ -414,27 +958,37 @@ void smtd_next_stage(smtd_state *state, smtd_stage next_stage) {
 
                 for (uint8_t j = i; j < smtd_active_states_size - 1; j++) {
                     smtd_active_states[j].macro_keycode = smtd_active_states[j + 1].macro_keycode;
+                    smtd_active_states[j].macro_key = smtd_active_states[j + 1].macro_key;
                     smtd_active_states[j].modes_before_touch = smtd_active_states[j + 1].modes_before_touch;
                     smtd_active_states[j].modes_with_touch = smtd_active_states[j + 1].modes_with_touch;
                     smtd_active_states[j].sequence_len = smtd_active_states[j + 1].sequence_len;
                     smtd_active_states[j].following_key = smtd_active_states[j + 1].following_key;
                     smtd_active_states[j].following_keycode = smtd_active_states[j + 1].following_keycode;
+                    smtd_active_states[j].touch_time = smtd_active_states[j + 1].touch_time;
+                    smtd_active_states[j].following_time = smtd_active_states[j + 1].following_time;
                     smtd_active_states[j].timeout = smtd_active_states[j + 1].timeout;
                     smtd_active_states[j].stage = smtd_active_states[j + 1].stage;
                     smtd_active_states[j].freeze = smtd_active_states[j + 1].freeze;
+                    smtd_active_states[j].speculative = smtd_active_states[j + 1].speculative;
+                    smtd_active_states[j].following_speculated = smtd_active_states[j + 1].following_speculated;
                 }
 
                 smtd_active_states_size--;
                 smtd_state *last_state = &smtd_active_states[smtd_active_states_size];
                 last_state->macro_keycode = 0;
+                last_state->macro_key = MAKE_KEYPOS(0, 0);
                 last_state->modes_before_touch = 0;
                 last_state->modes_with_touch = 0;
                 last_state->sequence_len = 0;
                 last_state->following_key = MAKE_KEYPOS(0, 0);
                 last_state->following_keycode = 0;
+                last_state->touch_time = 0;
+                last_state->following_time = 0;
                 last_state->timeout = INVALID_DEFERRED_TOKEN;
                 last_state->stage = SMTD_STAGE_NONE;
                 last_state->freeze = false;
+                last_state->speculative = false;
+                last_state->following_speculated = false;
 
                 break;
             }
@@ -442,15 +996,18 @@ void smtd_next_stage(smtd_state *state, smtd_stage next_stage) {
 
         case SMTD_STAGE_TOUCH:
             state->modes_before_touch = get_mods();
+            smtd_touch_speculative = false;
             SMTD_ACTION(SMTD_ACTION_TOUCH, state)
+            state->speculative = smtd_touch_speculative;
             state->modes_with_touch = get_mods() & ~state->modes_before_touch;
-            state->timeout = defer_exec(get_smtd_timeout_or_default(state->macro_keycode, SMTD_TIMEOUT_TAP),
-                                        timeout_touch, state);
+            state->touch_time = timer_read();
+            state->timeout = defer_exec(get_smtd_stage_timeout(state, SMTD_TIMEOUT_TAP),
+                                        timeout_touch, SMTD_CB_ARG(state));
             break;
 
         case SMTD_STAGE_SEQUENCE:
             state->timeout = defer_exec(get_smtd_timeout_or_default(state->macro_keycode, SMTD_TIMEOUT_SEQUENCE),
-                                        timeout_sequence, state);
+                                        timeout_sequence, SMTD_CB_ARG(state));
             break;
 
         case SMTD_STAGE_HOLD:
@@ -458,13 +1015,14 @@ void smtd_next_stage(smtd_state *state, smtd_stage next_stage) {
             break;
 
         case SMTD_STAGE_FOLLOWING_TOUCH:
-            state->timeout = defer_exec(get_smtd_timeout_or_default(state->macro_keycode, SMTD_TIMEOUT_FOLLOWING_TAP),
-                                        timeout_following_touch, state);
+            state->following_time = timer_read();
+            state->timeout = defer_exec(get_smtd_stage_timeout(state, SMTD_TIMEOUT_FOLLOWING_TAP),
+                                        timeout_following_touch, SMTD_CB_ARG(state));
             break;
 
         case SMTD_STAGE_RELEASE:
-            state->timeout = defer_exec(get_smtd_timeout_or_default(state->macro_keycode, SMTD_TIMEOUT_RELEASE),
-                                        timeout_release, state);
+            state->timeout = defer_exec(get_smtd_stage_timeout(state, SMTD_TIMEOUT_RELEASE),
+                                        timeout_release, SMTD_CB_ARG(state));
             break;
     }
 
@@ -477,194 +1035,8 @@ bool process_smtd_state(uint16_t keycode, keyrecord_t *record, smtd_state *state
         return true;
     }
 
-    switch (state->stage) {
-        case SMTD_STAGE_NONE:
-            if (keycode == state->macro_keycode && record->event.pressed) {
-                smtd_next_stage(state, SMTD_STAGE_TOUCH);
-                return false;
-            }
-            return true;
-
-        case SMTD_STAGE_TOUCH:
-            if (keycode == state->macro_keycode && !record->event.pressed) {
-                smtd_next_stage(state, SMTD_STAGE_SEQUENCE);
-
-                if (!smtd_feature_enabled_or_default(state->macro_keycode, SMTD_FEATURE_AGGREGATE_TAPS)) {
-                    DO_ACTION_TAP(state);
-                }
-
-                return false;
-            }
-            if (keycode != state->macro_keycode && record->event.pressed) {
-                state->following_key = record->event.key;
-                state->following_keycode = keycode;
-                smtd_next_stage(state, SMTD_STAGE_FOLLOWING_TOUCH);
-                return false;
-            }
-            return true;
-
-        case SMTD_STAGE_SEQUENCE:
-            if (keycode == state->macro_keycode && record->event.pressed) {
-                state->sequence_len++;
-                smtd_next_stage(state, SMTD_STAGE_TOUCH);
-                return false;
-            }
-            if (record->event.pressed) {
-                if (smtd_feature_enabled_or_default(state->macro_keycode, SMTD_FEATURE_AGGREGATE_TAPS)) {
-                    DO_ACTION_TAP(state);
-                }
-
-                smtd_next_stage(state, SMTD_STAGE_NONE);
-
-                return true;
-            }
-            return true;
-
-        case SMTD_STAGE_FOLLOWING_TOUCH:
-            // At this stage, we have already pressed the macro key and the following key
-            // none of them is assumed to be held yet
-
-            if (keycode == state->macro_keycode && !record->event.pressed) {
-                // Macro key is released, moving to the next stage
-                smtd_next_stage(state, SMTD_STAGE_RELEASE);
-                return false;
-            }
-
-            if (
-                    keycode != state->macro_keycode
-                    && (state->following_key.row == record->event.key.row &&
-                        state->following_key.col == record->event.key.col)
-                    && !record->event.pressed
-                    ) {
-                // Following key is released. Now we definitely know that macro key is held
-                // we need to execute hold the macro key and execute hold the following key
-                // and then press move to next stage
-                smtd_next_stage(state, SMTD_STAGE_HOLD);
-
-                SMTD_SIMULTANEOUS_PRESSES_DELAY
-                smtd_press_following_key(state, true);
-
-                return false;
-            }
-            if (
-                    keycode != state->macro_keycode
-                    && !(state->following_key.row == record->event.key.row &&
-                         state->following_key.col == record->event.key.col)
-                    && record->event.pressed
-                    ) {
-                // so, now we have 3rd key pressed
-                // we assume this to be hold macro key, hold following key and press the 3rd key
-
-                // need to put first key state into HOLD stage
-                smtd_next_stage(state, SMTD_STAGE_HOLD);
-
-                // then press and hold (without releasing) the following key
-                SMTD_SIMULTANEOUS_PRESSES_DELAY
-                smtd_press_following_key(state, false);
-
-                // then rerun the 3rd key press
-                // since we have just started hold stage, we need to simulate the press of the 3rd key again
-                // because by holding first two keys we might have changed a layer, so current keycode might be not actual
-                // if we don't do this, we might continue processing the wrong key
-                SMTD_SIMULTANEOUS_PRESSES_DELAY
-                state->freeze = true;
-                keyevent_t event_press = MAKE_KEYEVENT(record->event.key.row, record->event.key.col, true);
-                keyrecord_t record_press = {.event = event_press};
-                process_record(&record_press);
-                state->freeze = false;
-
-                // we have processed the 3rd key, so we intentionally return false to stop further processing
-                return false;
-            }
-            return true;
-
-        case SMTD_STAGE_HOLD:
-            if (keycode == state->macro_keycode && !record->event.pressed) {
-                SMTD_ACTION(SMTD_ACTION_RELEASE, state)
-
-                smtd_next_stage(state, SMTD_STAGE_NONE);
-
-                return false;
-            }
-            return true;
-
-        case SMTD_STAGE_RELEASE:
-            // At this stage we have just released the macro key and still holding the following key
-
-            if (keycode == state->macro_keycode && record->event.pressed) {
-                DO_ACTION_TAP(state);
-
-                SMTD_SIMULTANEOUS_PRESSES_DELAY
-                smtd_press_following_key(state, false);
-
-                //todo need to go to NONE stage and from NONE jump to TOUCH stage
-                SMTD_SIMULTANEOUS_PRESSES_DELAY
-                smtd_next_stage(state, SMTD_STAGE_TOUCH);
-
-                state->sequence_len = 0;
-
-                return false;
-            }
-            if (
-                    keycode != state->macro_keycode
-                    && (state->following_key.row == record->event.key.row &&
-                        state->following_key.col == record->event.key.col)
-                    && !record->event.pressed
-                    ) {
-                // Following key is released. Now we definitely know that macro key is held
-                // we need to execute hold the macro key and execute tap the following key
-                // then close the state
-
-                SMTD_ACTION(SMTD_ACTION_HOLD, state)
-
-                SMTD_SIMULTANEOUS_PRESSES_DELAY
-                smtd_press_following_key(state, true);
-
-                SMTD_SIMULTANEOUS_PRESSES_DELAY
-                SMTD_ACTION(SMTD_ACTION_RELEASE, state)
-
-                smtd_next_stage(state, SMTD_STAGE_NONE);
-
-                return false;
-            }
-            if (
-                    keycode != state->macro_keycode
-                    && (state->following_key.row != record->event.key.row ||
-                        state->following_key.col != record->event.key.col)
-                    && record->event.pressed
-                    ) {
-                // at this point we have already released the macro key and still holding the following key
-                // and we get 3rd key pressed
-                // we assume this to be tap macro key, press (w/o release) following key and press (w/o release) the 3rd key
-
-                // so we need to tap the macro key first
-                DO_ACTION_TAP(state)
-
-                // then press and hold (without releasing) the following key
-                SMTD_SIMULTANEOUS_PRESSES_DELAY
-                smtd_press_following_key(state, false);
-
-                // release current state, because the first key is already processed
-                smtd_next_stage(state, SMTD_STAGE_NONE);
-
-                // then rerun the 3rd key press
-                // since we have just press following state, we need to simulate the press of the 3rd key again
-                // because by pressing second key we might have changed a layer, so current keycode might be not actual
-                // if we don't do this, we might continue processing the wrong key
-                SMTD_SIMULTANEOUS_PRESSES_DELAY
-
-                // we also don't need to freeze the state here, because we are already put in NONE stage
-                keyevent_t event_press = MAKE_KEYEVENT(record->event.key.row, record->event.key.col, true);
-                keyrecord_t record_press = {.event = event_press};
-                process_record(&record_press);
-
-                // we have processed the 3rd key, so we intentionally return false to stop further processing
-                return false;
-            }
-            return true;
-    }
-
-    return true;
+    smtd_event event = smtd_classify_event(keycode, record, state);
+    return smtd_apply_transition(state, state->stage, event, keycode, record);
 }
 
 /* ************************************* *
@@ -717,6 +1089,7 @@ bool process_smtd(uint16_t keycode, keyrecord_t *record) {
     // create a new state and process the event
     smtd_state *state = &smtd_active_states[smtd_active_states_size];
     state->macro_keycode = keycode;
+    state->macro_key = record->event.key;
     smtd_active_states_size++;
 
     #ifdef SMTD_DEBUG_ENABLED
@@ -743,14 +1116,17 @@ bool process_smtd(uint16_t keycode, keyrecord_t *record) {
 #define SMTD_MT(...) SMTD_GET_MACRO(__VA_ARGS__, SMTD_MT5, SMTD_MT4, SMTD_MT3)(__VA_ARGS__)
 #define SMTD_MTE(...) SMTD_GET_MACRO(__VA_ARGS__, SMTD_MTE5, SMTD_MTE4, SMTD_MTE3)(__VA_ARGS__)
 #define SMTD_LT(...) SMTD_GET_MACRO(__VA_ARGS__, SMTD_LT5, SMTD_LT4, SMTD_LT3)(__VA_ARGS__)
+#define SMTD_LTE(...) SMTD_GET_MACRO(__VA_ARGS__, SMTD_LTE5, SMTD_LTE4, SMTD_LTE3)(__VA_ARGS__)
 
 #define SMTD_MT3(macro_key, tap_key, mod) SMTD_MT4(macro_key, tap_key, mod, 1000)
 #define SMTD_MTE3(macro_key, tap_key, mod) SMTD_MTE4(macro_key, tap_key, mod, 1000)
 #define SMTD_LT3(macro_key, tap_key, layer) SMTD_LT4(macro_key, tap_key, layer, 1000)
+#define SMTD_LTE3(macro_key, tap_key, layer) SMTD_LTE4(macro_key, tap_key, layer, 1000)
 
 #define SMTD_MT4(macro_key, tap_key, mod, threshold) SMTD_MT5(macro_key, tap_key, mod, threshold, true)
 #define SMTD_MTE4(macro_key, tap_key, mod, threshold) SMTD_MTE5(macro_key, tap_key, mod, threshold, true)
 #define SMTD_LT4(macro_key, tap_key, layer, threshold) SMTD_LT5(macro_key, tap_key, layer, threshold, true)
+#define SMTD_LTE4(macro_key, tap_key, layer, threshold) SMTD_LTE5(macro_key, tap_key, layer, threshold, true)
 
 #define SMTD_MT5(macro_key, tap_key, mod, threshold, use_cl)  \
     case macro_key: {                                         \
@@ -817,14 +1193,14 @@ bool process_smtd(uint16_t keycode, keyrecord_t *record) {
                 break;                                        \
             case SMTD_ACTION_HOLD:                            \
                 if (tap_count < threshold) {                  \
-                    LAYER_PUSH(layer);                        \
+                    SMTD_LAYER_PUSH(macro_key, layer);        \
                 } else {                                      \
                     SMTD_REGISTER_16(use_cl, tap_key);        \
                 }                                             \
                 break;                                        \
             case SMTD_ACTION_RELEASE:                         \
                 if (tap_count < threshold) {                  \
-                    LAYER_RESTORE();                          \
+                    SMTD_LAYER_RESTORE(macro_key);            \
                 }                                             \
                 SMTD_UNREGISTER_16(use_cl, tap_key);          \
                 break;                                        \
@@ -832,3 +1208,41 @@ bool process_smtd(uint16_t keycode, keyrecord_t *record) {
         break;                                                \
     }
 
+// Speculative version of SMTD_LT: the layer is turned on right on touch and the key following the macro key
+// is emitted on it at once, without waiting for the tap/hold decision. Nothing is buffered, so if the macro key
+// turns out to be a tap, the host has already seen that key on the layer: it is released, the layer is rolled back
+// and the key is pressed again on the base layer. Put on the layer only keys that are harmless to send by mistake.
+// Keys with aggregated taps and following sm_td macro keys are not speculated and behave like with SMTD_LT.
+#define SMTD_LTE5(macro_key, tap_key, layer, threshold, use_cl)\
+    case macro_key: {                                         \
+        switch (action) {                                     \
+            case SMTD_ACTION_TOUCH:                           \
+                if (tap_count < threshold                     \
+                    && SMTD_CAN_SPECULATE(macro_key)) {       \
+                    SMTD_LAYER_PUSH(macro_key, layer);        \
+                    SMTD_SPECULATE();                         \
+                }                                             \
+                break;                                        \
+            case SMTD_ACTION_TAP:                             \
+                SMTD_LAYER_RESTORE(macro_key);                \
+                SMTD_TAP_16(use_cl, tap_key);                 \
+                break;                                        \
+            case SMTD_ACTION_HOLD:                            \
+                if (tap_count < threshold) {                  \
+                    SMTD_LAYER_PUSH(macro_key, layer);        \
+                } else {                                      \
+                    SMTD_LAYER_RESTORE(macro_key);            \
+                    SMTD_REGISTER_16(use_cl, tap_key);        \
+                }                                             \
+                break;                                        \
+            case SMTD_ACTION_RELEASE:                         \
+                if (tap_count < threshold) {                  \
+                    SMTD_LAYER_RESTORE(macro_key);            \
+                } else {                                      \
+                    SMTD_UNREGISTER_16(use_cl, tap_key);      \
+                }                                             \
+                break;                                        \
+        }                                                     \
+        break;                                                \
+    }
+
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+# Copyright 2024 Stanislav Markin (https://github.com/stasmarkin)
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+"""
+Checks that two versions of `sm_td.h` behave the same: builds the host remapper (`host/`) with each of them
+and compares what they emit on random key event streams (`smtd-host -f` format).
+Meant for refactorings of the state machine, e.g. against the header before the change:
+
+    git show HEAD~1:sm_td.h > /tmp/sm_td_before.h
+    tools/smtd_compare_headers.py /tmp/sm_td_before.h
+    tools/smtd_compare_headers.py -D SMTD_GLOBAL_AGGREGATE_TAPS=true /tmp/sm_td_before.h
+
+Streams mix fast rolls and slow holds over the keys of the keymap, so all stages and timeouts are visited.
+The first differing stream is kept in the work directory and its path is printed.
+"""
+
+import argparse
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+HOST = os.path.join(REPO, "host")
+HOST_SOURCES = ["smtd_daemon.c", "smtd_host.c", "smtd_trace.c"]
+
+# home row mods and space of host/keymap.c, a few plain keys around them and H for the nav layer
+DEFAULT_KEYS = "30,31,32,33,36,37,38,39,57,35,16,17,18,19,22,23,24,25"
+
+
+def build(header, keymap, defines, work_dir, name):
+    include_dir = os.path.join(work_dir, name)
+    os.makedirs(include_dir, exist_ok=True)
+    shutil.copyfile(header, os.path.join(include_dir, "sm_td.h"))
+
+    binary = os.path.join(work_dir, name + ".bin")
+    # host/ has no sm_td.h of its own, so the copy is found before the one in the repo root
+    command = [os.environ.get("CC", "cc"), "-std=gnu11", "-O2", "-w", "-I" + include_dir, "-I" + HOST,
+               "-DQMK_KEYBOARD_H=\"smtd_host.h\""]
+    command += ["-D" + define for define in defines]
+    command += [os.path.join(HOST, source) for source in HOST_SOURCES] + [keymap, "-o", binary]
+    subprocess.run(command, check=True)
+    return binary
+
+
+def random_stream(rng, keys, events):
+    """Random presses and releases, gaps are either short (rolls) or around the terms (holds, timeouts)"""
+    lines = []
+    pressed = []
+    time_ms = 0
+    while len(lines) < events or pressed:
+        time_ms += rng.randint(0, 60) if rng.random() < 0.7 else rng.randint(60, 400)
+
+        release = pressed and (len(lines) >= events or len(pressed) >= 3 or rng.random() < 0.5)
+        if release:
+            code = pressed.pop(rng.randrange(len(pressed)))
+            lines.append(f"{time_ms} {code} 0")
+        else:
+            code = rng.choice([key for key in keys if key not in pressed])
+            pressed.append(code)
+            lines.append(f"{time_ms} {code} 1")
+    return "\n".join(lines) + "\n"
+
+
+def run(binary, stream):
+    return subprocess.run([binary, "-f", "-"], input=stream, capture_output=True, text=True, check=True).stdout
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("base", help="sm_td.h to compare with")
+    parser.add_argument("--header", default=os.path.join(REPO, "sm_td.h"), help="sm_td.h under test")
+    parser.add_argument("--keymap", default=os.path.join(HOST, "keymap.c"), help="host keymap to build with")
+    parser.add_argument("-D", dest="defines", action="append", default=[], help="extra define for both builds")
+    parser.add_argument("-n", "--streams", type=int, default=200, help="number of random streams")
+    parser.add_argument("-e", "--events", type=int, default=400, help="key events per stream")
+    parser.add_argument("-k", "--keys", default=DEFAULT_KEYS, help="comma separated evdev codes to press")
+    parser.add_argument("-s", "--seed", type=int, default=1, help="random seed")
+    args = parser.parse_args()
+
+    keys = [int(key) for key in args.keys.split(",")]
+    rng = random.Random(args.seed)
+    work_dir = tempfile.mkdtemp(prefix="smtd_compare_")
+
+    base = build(args.base, args.keymap, args.defines, work_dir, "base")
+    test = build(args.header, args.keymap, args.defines, work_dir, "test")
+
+    emitted = 0
+    for i in range(args.streams):
+        stream = random_stream(rng, keys, args.events)
+        expected = run(base, stream)
+        actual = run(test, stream)
+        if expected != actual:
+            path = os.path.join(work_dir, f"stream_{i}.txt")
+            with open(path, "w") as f:
+                f.write(stream)
+            sys.exit(f"stream {i} differs, replay it with smtd-host -f {path}")
+        emitted += expected.count("\n")
+
+    shutil.rmtree(work_dir)
+    print(f"{args.streams} streams of {args.events} events, {emitted} emitted events, no differences")
+
+
+if __name__ == "__main__":
+    main()
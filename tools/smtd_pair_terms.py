@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+# Copyright 2024 Stanislav Markin (https://github.com/stasmarkin)
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+"""
+Generates `smtd_pair_terms.h` with per key pair RELEASE and FOLLOWING_TAP terms
+stored in a minimal perfect hash table (see SMTD_PAIR_TERMS_ENABLED in sm_td.h).
+
+Pairs are described by matrix positions, one pair per line:
+
+    # macro_row macro_col following_row following_col release following_tap
+    1 3 1 2  20 -
+    1 3 1 8  60 150
+
+`-` (or 0) means "not set", so sm_td falls back to the per key timeout.
+"""
+
+import argparse
+import sys
+
+MASK32 = 0xFFFFFFFF
+MAX_DISPLACEMENT = 255
+MAX_SEEDS = 10000
+
+
+def pair_key(macro_row, macro_col, following_row, following_col):
+    return (macro_row << 24) | (macro_col << 16) | (following_row << 8) | following_col
+
+
+def pair_hash(pair, seed):
+    # must match smtd_pair_hash() in sm_td.h
+    x = (pair ^ seed) & MASK32
+    x ^= x >> 16
+    x = (x * 0x7FEB352D) & MASK32
+    x ^= x >> 15
+    x = (x * 0x846CA68B) & MASK32
+    x ^= x >> 16
+    return x
+
+
+def parse_term(value, line_no):
+    if value == "-":
+        return 0
+    term = int(value, 0)
+    if not 0 <= term <= 0xFFFF:
+        sys.exit(f"line {line_no}: term {term} does not fit into 16 bits")
+    return term
+
+
+def parse_pairs(lines):
+    pairs = {}
+    for line_no, line in enumerate(lines, 1):
+        line = line.split("#", 1)[0].strip()
+        if not line:
+            continue
+        fields = line.split()
+        if len(fields) != 6:
+            sys.exit(f"line {line_no}: expected 6 fields, got {len(fields)}")
+        position = [int(v, 0) for v in fields[:4]]
+        if any(not 0 <= v <= 0xFF for v in position):
+            sys.exit(f"line {line_no}: matrix position does not fit into 8 bits")
+        key = pair_key(*position)
+        if key in pairs:
+            sys.exit(f"line {line_no}: duplicated pair")
+        pairs[key] = (parse_term(fields[4], line_no), parse_term(fields[5], line_no))
+    return pairs
+
+
+def build_table(keys):
+    size = len(keys)
+    buckets_count = max(1, (size + 1) // 2)
+
+    for seed in range(MAX_SEEDS):
+        buckets = [[] for _ in range(buckets_count)]
+        for key in keys:
+            buckets[pair_hash(key, seed) % buckets_count].append(key)
+
+        slots = [None] * size
+        displacement = [0] * buckets_count
+        order = sorted(range(buckets_count), key=lambda b: -len(buckets[b]))
+        for bucket in order:
+            if not buckets[bucket]:
+                continue
+            for d in range(MAX_DISPLACEMENT + 1):
+                candidate = [pair_hash(key, (seed + 1 + d) & MASK32) % size for key in buckets[bucket]]
+                if len(set(candidate)) == len(candidate) and all(slots[s] is None for s in candidate):
+                    for key, slot in zip(buckets[bucket], candidate):
+                        slots[slot] = key
+                    displacement[bucket] = d
+                    break
+            else:
+                break
+        else:
+            return seed, displacement, slots
+
+    sys.exit("could not build a perfect hash table, try to split the pairs")
+
+
+def render(source, pairs, seed, displacement, slots):
+    out = [
+        f"// Generated by tools/smtd_pair_terms.py from {source}, do not edit",
+        "#pragma once",
+        "",
+        f"#define SMTD_PAIR_TERMS_SIZE {len(slots)}",
+        f"#define SMTD_PAIR_TERMS_BUCKETS {len(displacement)}",
+        f"#define SMTD_PAIR_TERMS_SEED {seed}UL",
+        "",
+        "static const uint8_t smtd_pair_terms_displacement[SMTD_PAIR_TERMS_BUCKETS] PROGMEM = {",
+    ]
+    out += [f"    {d}," for d in displacement]
+    out += [
+        "};",
+        "",
+        "static const smtd_pair_term smtd_pair_terms[SMTD_PAIR_TERMS_SIZE] PROGMEM = {",
+    ]
+    for key in slots:
+        release, following_tap = pairs[key]
+        out.append(f"    {{.pair = 0x{key:08X}UL, .release = {release}, .following_tap = {following_tap}}},")
+    out += ["};", ""]
+    return "\n".join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("pairs", help="pairs description file ('-' for stdin)")
+    parser.add_argument("-o", "--output", default="smtd_pair_terms.h", help="generated header path")
+    args = parser.parse_args()
+
+    if args.pairs == "-":
+        pairs = parse_pairs(sys.stdin)
+    else:
+        with open(args.pairs) as f:
+            pairs = parse_pairs(f)
+    if not pairs:
+        sys.exit("no pairs defined")
+
+    seed, displacement, slots = build_table(list(pairs))
+    with open(args.output, "w") as f:
+        f.write(render(args.pairs, pairs, seed, displacement, slots))
+
+
+if __name__ == "__main__":
+    main()